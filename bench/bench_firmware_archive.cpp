@@ -0,0 +1,209 @@
+/* Microbenchmark for the firmware archive (FMI) reader.
+ *
+ * Generates a synthetic multi-image FMI bundle in memory, similar to one that
+ * holds firmware for a whole product family, and measures how long it takes
+ * to load with the old reader (reproduced below) and with
+ * FirmwareArchive::Data.  Then it checks that both readers got the same data.
+ *
+ * Usage: bench_firmware_archive [IMAGE_COUNT] [KILOBYTES_PER_IMAGE] */
+
+#include "firmware_archive.h"
+
+#include <tinyxml2.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// The old reader, which copied the file into an std::stringstream and then
+// into an std::string before parsing it, and decoded the contents of each
+// block with an std::istringstream and a sentry per byte.
+namespace legacy
+{
+    static int hexDigitValue(unsigned char c)
+    {
+        if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+        if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
+        if (c >= '0' && c <= '9') { return c - '0'; }
+        return -1;
+    }
+
+    static uint8_t readHexByte(std::istream & s)
+    {
+        std::istream::sentry sentry(s, true);
+        if (sentry)
+        {
+            char c1 = 0, c2 = 0;
+            s.get(c1);
+            s.get(c2);
+            if (s.fail()) { throw std::runtime_error("Unexpected end of line."); }
+            int v1 = hexDigitValue(c1);
+            int v2 = hexDigitValue(c2);
+            if (v1 < 0 || v2 < 0) { throw std::runtime_error("Invalid hex digit."); }
+            return v1 * 16 + v2;
+        }
+        return 0;
+    }
+
+    static FirmwareArchive::Block processBlock(const tinyxml2::XMLElement * element)
+    {
+        FirmwareArchive::Block block;
+        block.address = std::stoul(std::string(element->Attribute("address")), 0, 16);
+        std::string contents(element->GetText());
+        if (contents.size() % 2) { throw std::runtime_error("Odd number of characters."); }
+        uint32_t byteCount = contents.size() / 2;
+        std::istringstream stream(contents);
+        block.data.resize(byteCount);
+        for (uint32_t i = 0; i < byteCount; i++)
+        {
+            block.data[i] = readHexByte(stream);
+        }
+        return block;
+    }
+
+    static std::vector<FirmwareArchive::Image> read(std::istream & file)
+    {
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        std::string string = buffer.str();
+
+        tinyxml2::XMLDocument doc;
+        doc.Parse(string.c_str(), string.size());
+        if (doc.Error()) { throw std::runtime_error("XML error."); }
+
+        std::vector<FirmwareArchive::Image> images;
+        const tinyxml2::XMLElement * root = doc.RootElement();
+        for (const tinyxml2::XMLElement * imageElement = root->FirstChildElement("FirmwareImage");
+             imageElement != NULL; imageElement = imageElement->NextSiblingElement("FirmwareImage"))
+        {
+            FirmwareArchive::Image image;
+            image.usbProductId = std::stoul(std::string(imageElement->Attribute("product")), 0, 16);
+            for (const tinyxml2::XMLElement * blockElement = imageElement->FirstChildElement("Block");
+                 blockElement != NULL; blockElement = blockElement->NextSiblingElement("Block"))
+            {
+                image.blocks.push_back(processBlock(blockElement));
+            }
+            images.push_back(image);
+        }
+        return images;
+    }
+}
+
+// Makes an FMI file with the specified number of images, each holding the
+// specified number of bytes of pseudo-random data in 1 KB blocks.
+static std::string makeFmiFile(uint32_t imageCount, uint32_t bytesPerImage)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    std::string out;
+    out += "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n";
+    out += "<FirmwareArchive format=\"1.0\" name=\"bench\">\n";
+    uint32_t seed = 1;
+    for (uint32_t i = 0; i < imageCount; i++)
+    {
+        char line[80];
+        snprintf(line, sizeof(line),
+            "  <FirmwareImage product=\"%04X\" uploadType=\"Standard\">\n",
+            0x00B0 + i);
+        out += line;
+        for (uint32_t address = 0; address < bytesPerImage; address += 1024)
+        {
+            snprintf(line, sizeof(line), "    <Block address=\"%X\">",
+                0x2000 + address);
+            out += line;
+            for (uint32_t j = 0; j < 1024 && address + j < bytesPerImage; j++)
+            {
+                seed = seed * 1103515245 + 12345;
+                uint8_t b = seed >> 16;
+                out += digits[b >> 4];
+                out += digits[b & 15];
+            }
+            out += "</Block>\n";
+        }
+        out += "  </FirmwareImage>\n";
+    }
+    out += "</FirmwareArchive>\n";
+    return out;
+}
+
+// Runs the function several times and returns the best time in seconds.
+static double timeBest(std::function<void()> f)
+{
+    double best = 1e9;
+    for (int i = 0; i < 5; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (elapsed.count() < best) { best = elapsed.count(); }
+    }
+    return best;
+}
+
+static void report(const char * name, double seconds, size_t fileSize)
+{
+    printf("%-28s %9.3f ms %9.1f MB/s\n", name, seconds * 1000,
+        fileSize / seconds / 1e6);
+}
+
+int main(int argc, char ** argv)
+{
+    uint32_t imageCount = argc > 1 ? strtoul(argv[1], NULL, 10) : 8;
+    uint32_t kilobytes = argc > 2 ? strtoul(argv[2], NULL, 10) : 256;
+    std::string file = makeFmiFile(imageCount, kilobytes << 10);
+    printf("FMI file: %zu bytes, %u images of %u KB\n", file.size(),
+        imageCount, kilobytes);
+
+    double legacyTime = timeBest([&]()
+    {
+        std::istringstream stream(file);
+        legacy::read(stream);
+    });
+
+    double streamTime = timeBest([&]()
+    {
+        std::istringstream stream(file);
+        FirmwareArchive::Data data;
+        data.readFromFile(stream, "bench.fmi");
+    });
+
+    double bufferTime = timeBest([&]()
+    {
+        FirmwareArchive::Data data;
+        data.readFromBuffer(file.data(), file.size(), "bench.fmi");
+    });
+
+    // Make sure the current reader gets the right data.
+    FirmwareArchive::Data data;
+    data.readFromBuffer(file.data(), file.size(), "bench.fmi");
+    std::istringstream stream(file);
+    std::vector<FirmwareArchive::Image> images = legacy::read(stream);
+    bool match = images.size() == data.images.size();
+    for (size_t i = 0; match && i < images.size(); i++)
+    {
+        const FirmwareArchive::Image & a = images[i];
+        const FirmwareArchive::Image & b = data.images[i];
+        match = a.usbProductId == b.usbProductId &&
+            a.blocks.size() == b.blocks.size();
+        for (size_t j = 0; match && j < a.blocks.size(); j++)
+        {
+            match = a.blocks[j].address == b.blocks[j].address &&
+                a.blocks[j].data == b.blocks[j].data;
+        }
+    }
+    if (!match)
+    {
+        fprintf(stderr, "The readers got different data.\n");
+        return 1;
+    }
+
+    report("legacy reader", legacyTime, file.size());
+    report("readFromFile (stream)", streamTime, file.size());
+    report("readFromBuffer", bufferTime, file.size());
+    printf("Speedup of readFromBuffer: %.1fx\n", legacyTime / bufferTime);
+    return 0;
+}
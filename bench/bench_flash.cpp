@@ -0,0 +1,223 @@
+/* End-to-end benchmark for writing to devices.
+ *
+ * Runs p-load in-process through ploadMain, which is the same code path as
+ * the command line, against simulated bootloaders with realistic latencies.
+ * It covers HEX and FMI files, flash-only and flash+EEPROM writes, mostly blank
+ * and dense images, and 1 to 32 devices at once.  For each run it prints one
+ * line of JSON with the wall time, the number of requests of each type, and
+ * the number of bytes transferred per second.
+ *
+ * Usage: bench_flash [LATENCIES]
+ *
+ * LATENCIES replaces the default simulated latencies, using the settings
+ * described in ploader_sim.h (e.g. "erase=2000,write-flash=800").  Use "none"
+ * to simulate instantaneous devices, which measures p-load's own overhead. */
+
+#include "p-load.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Rough latencies of real bootloaders on a full-speed USB bus, in
+// microseconds (except reconnect, which is in milliseconds).
+static const char defaultLatencies[] =
+    "enumerate=5000,transfer=300,erase=4000,write-flash=1500,"
+    "read-flash=1200,write-eeprom=3500,read-eeprom=400,reconnect=500";
+
+static const uint32_t deviceCounts[] = { 1, 2, 4, 8, 16, 32 };
+
+// The number of bytes at the start of the app in the mostly-blank images.
+static const uint32_t sparseAppSize = 2048;
+
+class Scenario
+{
+public:
+    const char * name;
+    const char * userType;
+    const char * fileName;
+    const char * writeOption;
+};
+
+static const Scenario scenarios[] = {
+    { "hex-flash-dense", "p-star-25k50", "bench_flash_dense.hex", "--write-flash" },
+    { "hex-flash-sparse", "p-star-25k50", "bench_flash_sparse.hex", "--write-flash" },
+    { "hex-all-dense", "p-star-25k50", "bench_flash_dense.hex", "--write" },
+    { "hex-all-sparse", "p-star-25k50", "bench_flash_sparse.hex", "--write" },
+    { "fmi-dense", "jrk", "bench_flash_dense.fmi", "--write" },
+    { "fmi-sparse", "jrk", "bench_flash_sparse.fmi", "--write" },
+};
+
+static uint32_t randomSeed = 1;
+
+static std::vector<uint8_t> randomData(size_t size)
+{
+    std::vector<uint8_t> data(size);
+    for (uint8_t & b : data)
+    {
+        randomSeed = randomSeed * 1103515245 + 12345;
+        b = randomSeed >> 16;
+    }
+    return data;
+}
+
+static PloaderType getType(const char * userType)
+{
+    return ploaderUserTypeLookup(userType)->getMatchingTypes().at(0);
+}
+
+static void makeHexFile(const char * fileName, uint32_t appSize,
+    uint32_t eepromSize)
+{
+    PloaderType type = getType("p-star-25k50");
+    IntelHex::Data data;
+    data.setImage(type.appAddress, randomData(appSize));
+    data.setImage(type.eepromAddressHexFile, randomData(eepromSize));
+    std::ofstream file(fileName);
+    data.writeToFile(file);
+}
+
+// Makes an FMI file with an image for each of the bootloaders in the Jrk G2
+// family, like the bundles that Pololu distributes.
+static void makeFmiFile(const char * fileName, uint32_t appSize)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    std::ofstream file(fileName);
+    file << "<FirmwareArchive format=\"1.0\" name=\"bench\">\n";
+    for (const PloaderType & type : ploaderUserTypeLookup("jrk")->getMatchingTypes())
+    {
+        char line[80];
+        snprintf(line, sizeof(line), "<FirmwareImage product=\"%04X\">\n",
+            type.usbProductId);
+        file << line;
+        std::vector<uint8_t> data = randomData(appSize);
+        for (uint32_t offset = 0; offset < appSize; offset += type.writeBlockSize)
+        {
+            snprintf(line, sizeof(line), "<Block address=\"%X\">",
+                type.appAddress + offset);
+            file << line;
+            for (uint32_t i = 0; i < type.writeBlockSize; i++)
+            {
+                uint8_t b = data[offset + i];
+                file << digits[b >> 4] << digits[b & 15];
+            }
+            file << "</Block>\n";
+        }
+        file << "</FirmwareImage>\n";
+    }
+    file << "</FirmwareArchive>\n";
+}
+
+// Runs p-load with the specified arguments, with its output discarded.
+static int runPload(std::vector<std::string> args)
+{
+    args.insert(args.begin(), "p-load");
+    std::vector<char *> argv;
+    for (std::string & arg : args)
+    {
+        argv.push_back(&arg[0]);
+    }
+
+    // Like the real argv, the list ends with a null pointer.
+    argv.push_back(NULL);
+
+    std::ostringstream discard;
+    std::streambuf * coutBuffer = std::cout.rdbuf(discard.rdbuf());
+    std::streambuf * cerrBuffer = std::cerr.rdbuf(discard.rdbuf());
+    int exitCode = ploadMain(args.size(), &argv[0]);
+    std::cout.rdbuf(coutBuffer);
+    std::cerr.rdbuf(cerrBuffer);
+    return exitCode;
+}
+
+static void runScenario(const Scenario & scenario, uint32_t deviceCount,
+    const std::string & latencies)
+{
+    std::string settings = std::string("type=") + scenario.userType +
+        ",count=" + std::to_string(deviceCount);
+    if (!latencies.empty())
+    {
+        settings += "," + latencies;
+    }
+    std::shared_ptr<PloaderSimBus> bus = PloaderSimBus::create(settings);
+    ploaderSetBus(bus);
+
+    std::vector<std::string> args = { "-t", scenario.userType,
+        scenario.writeOption, scenario.fileName };
+    if (deviceCount > 1)
+    {
+        args.push_back("--all");
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    int exitCode = runPload(args);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    ploaderSetBus(NULL);
+
+    uint32_t totalRequests = 0;
+    std::string requestCounts;
+    for (uint32_t request = 0; request < 256; request++)
+    {
+        uint32_t count = bus->getRequestCount(request);
+        if (count == 0) { continue; }
+        totalRequests += count;
+        const char * name = ploaderRequestName(request);
+        if (!requestCounts.empty()) { requestCounts += ","; }
+        requestCounts += std::string("\"") + (name ? name : "unknown") +
+            "\":" + std::to_string(count);
+    }
+
+    uint64_t bytes = bus->getByteCount();
+    printf("{\"scenario\":\"%s\",\"devices\":%u,\"exit_code\":%d,"
+        "\"wall_ms\":%.3f,\"requests\":%u,\"request_counts\":{%s},"
+        "\"bytes\":%llu,\"bytes_per_second\":%.0f}\n",
+        scenario.name, deviceCount, exitCode, elapsed.count() * 1000,
+        totalRequests, requestCounts.c_str(), (unsigned long long)bytes,
+        bytes / elapsed.count());
+    fflush(stdout);
+}
+
+int main(int argc, char ** argv)
+{
+    std::string latencies = defaultLatencies;
+    if (argc > 1)
+    {
+        latencies = argv[1];
+        if (latencies == "none") { latencies = ""; }
+    }
+
+    PloaderType type = getType("p-star-25k50");
+    makeHexFile("bench_flash_dense.hex", type.appSize, type.eepromSize);
+    makeHexFile("bench_flash_sparse.hex", sparseAppSize, 16);
+    makeFmiFile("bench_flash_dense.fmi", getType("jrk").appSize);
+    makeFmiFile("bench_flash_sparse.fmi", sparseAppSize);
+
+    int result = 0;
+    try
+    {
+        for (const Scenario & scenario : scenarios)
+        {
+            for (uint32_t deviceCount : deviceCounts)
+            {
+                runScenario(scenario, deviceCount, latencies);
+            }
+        }
+    }
+    catch(const std::exception & error)
+    {
+        fprintf(stderr, "Error: %s\n", error.what());
+        result = 1;
+    }
+
+    for (const Scenario & scenario : scenarios)
+    {
+        remove(scenario.fileName);
+    }
+    return result;
+}
@@ -0,0 +1,299 @@
+/* Microbenchmark for the Intel HEX parser and writer.
+ *
+ * Generates a synthetic HEX file in memory and measures how long it takes to
+ * parse with the old line-by-line stream parser (reproduced below) and with
+ * the current IntelHex::Data parser.  Then it writes the data back out to a
+ * file with the old ostream-based writer (also reproduced below) and with
+ * IntelHex::Data::writeToFile, and checks that the output is identical.
+ *
+ * Usage: bench_intel_hex [MEGABYTES_OF_DATA] */
+
+#include "intel_hex.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// The old parser, which used std::getline, an std::istringstream per line,
+// a sentry per byte, and a std::vector per record.
+namespace legacy
+{
+    class Entry
+    {
+    public:
+        Entry(uint32_t address, std::vector<uint8_t> data)
+            : address(address), data(data)
+        {
+        }
+
+        uint32_t address;
+        std::vector<uint8_t> data;
+    };
+
+    static int hexDigitValue(unsigned char c)
+    {
+        if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+        if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
+        if (c >= '0' && c <= '9') { return c - '0'; }
+        return -1;
+    }
+
+    static uint8_t readHexByte(std::istream & s)
+    {
+        std::istream::sentry sentry(s, true);
+        if (sentry)
+        {
+            char c1 = 0, c2 = 0;
+            s.get(c1);
+            s.get(c2);
+            if (s.fail()) { throw std::runtime_error("Unexpected end of line."); }
+            int v1 = hexDigitValue(c1);
+            int v2 = hexDigitValue(c2);
+            if (v1 < 0 || v2 < 0) { throw std::runtime_error("Invalid hex digit."); }
+            return v1 * 16 + v2;
+        }
+        return 0;
+    }
+
+    static void parse(std::istream & file, std::vector<Entry> & entries)
+    {
+        uint16_t addressHigh = 0;
+        while (1)
+        {
+            std::string lineString;
+            std::getline(file, lineString);
+            if (file.fail()) { throw std::runtime_error("Unexpected end of file."); }
+            std::istringstream lineStream(lineString);
+
+            char start;
+            lineStream.get(start);
+            if (start != ':') { throw std::runtime_error("No colon."); }
+
+            uint8_t byteCount = readHexByte(lineStream);
+            uint16_t addressLow = readHexByte(lineStream) << 8;
+            addressLow += readHexByte(lineStream);
+            uint8_t recordType = readHexByte(lineStream);
+
+            std::vector<uint8_t> data(byteCount);
+            for (uint32_t i = 0; i < byteCount; i++)
+            {
+                data[i] = readHexByte(lineStream);
+            }
+
+            uint8_t checksum = readHexByte(lineStream);
+            uint8_t sum = byteCount + (addressLow & 0xFF) + (addressLow >> 8) + recordType;
+            for (uint32_t i = 0; i < byteCount; i++) { sum += data[i]; }
+            if (checksum != (uint8_t)-sum) { throw std::runtime_error("Bad checksum."); }
+
+            if (recordType == 4) { addressHigh = (data[0] << 8) + data[1]; }
+            else if (recordType == 0)
+            {
+                entries.push_back(Entry(addressLow + (addressHigh << 16), data));
+            }
+            else if (recordType == 1) { return; }
+        }
+    }
+
+    static void writeHexLine(std::ostream & file, uint8_t recordType,
+        uint16_t addressLow, const std::vector<uint8_t> & data)
+    {
+        file << ':';
+        file << std::setw(2) << data.size();
+        file << std::setw(4) << addressLow;
+        file << std::setw(2) << (unsigned int)recordType;
+
+        uint8_t sum = data.size() + (addressLow >> 8) + addressLow + recordType;
+        for (uint8_t dataByte : data)
+        {
+            file << std::setw(2) << (unsigned int)dataByte;
+            sum += dataByte;
+        }
+
+        uint8_t checksum = -sum;
+        file << std::setw(2) << (unsigned int)checksum;
+        file << std::endl;
+    }
+
+    static void write(std::ostream & file, const std::vector<Entry> & entries)
+    {
+        uint32_t lastAddress = 0;
+        file << std::uppercase;
+        file << std::hex << std::setfill('0') << std::right;
+        for (const Entry & entry : entries)
+        {
+            uint32_t address = entry.address;
+            if ((address >> 16) != (lastAddress >> 16))
+            {
+                writeHexLine(file, 4, 0, {(uint8_t)(address >> 24), (uint8_t)(address >> 16)});
+            }
+            writeHexLine(file, 0, address & 0xFFFF, entry.data);
+            lastAddress = address;
+        }
+        writeHexLine(file, 1, 0, {});
+    }
+}
+
+static void appendHexLine(std::string & out, uint8_t recordType,
+    uint16_t addressLow, const uint8_t * data, uint8_t size)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    uint8_t header[4] = { size, (uint8_t)(addressLow >> 8),
+        (uint8_t)addressLow, recordType };
+    uint8_t sum = 0;
+    out += ':';
+    for (uint8_t b : header) { out += digits[b >> 4]; out += digits[b & 15]; sum += b; }
+    for (uint8_t i = 0; i < size; i++)
+    {
+        out += digits[data[i] >> 4];
+        out += digits[data[i] & 15];
+        sum += data[i];
+    }
+    uint8_t checksum = -sum;
+    out += digits[checksum >> 4];
+    out += digits[checksum & 15];
+    out += '\n';
+}
+
+// Makes a HEX file with the specified number of bytes of pseudo-random data.
+static std::string makeHexFile(uint32_t byteCount)
+{
+    std::string out;
+    uint32_t seed = 1;
+    for (uint32_t address = 0; address < byteCount; address += 16)
+    {
+        if ((address & 0xFFFF) == 0)
+        {
+            uint8_t high[2] = { (uint8_t)(address >> 24), (uint8_t)(address >> 16) };
+            appendHexLine(out, 4, 0, high, 2);
+        }
+        uint8_t data[16];
+        for (uint8_t & b : data)
+        {
+            seed = seed * 1103515245 + 12345;
+            b = seed >> 16;
+        }
+        appendHexLine(out, 0, address & 0xFFFF, data, 16);
+    }
+    appendHexLine(out, 1, 0, NULL, 0);
+    return out;
+}
+
+// Runs the function several times and returns the best time in seconds.
+static double timeBest(std::function<void()> f)
+{
+    double best = 1e9;
+    for (int i = 0; i < 5; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (elapsed.count() < best) { best = elapsed.count(); }
+    }
+    return best;
+}
+
+static void report(const char * name, double seconds, size_t fileSize)
+{
+    printf("%-28s %9.3f ms %9.1f MB/s\n", name, seconds * 1000,
+        fileSize / seconds / 1e6);
+}
+
+int main(int argc, char ** argv)
+{
+    uint32_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 10) : 4;
+    uint32_t byteCount = megabytes << 20;
+    std::string file = makeHexFile(byteCount);
+    printf("HEX file: %zu bytes, %u bytes of data\n", file.size(), byteCount);
+
+    double legacyTime = timeBest([&]()
+    {
+        std::istringstream stream(file);
+        std::vector<legacy::Entry> entries;
+        legacy::parse(stream, entries);
+    });
+
+    double streamTime = timeBest([&]()
+    {
+        std::istringstream stream(file);
+        IntelHex::Data data;
+        data.readFromFile(stream, "bench.hex");
+    });
+
+    double bufferTime = timeBest([&]()
+    {
+        IntelHex::Data data;
+        data.readFromBuffer(file.data(), file.size(), "bench.hex");
+    });
+
+    // Make sure the current parser gets the right data.
+    IntelHex::Data data;
+    data.readFromBuffer(file.data(), file.size(), "bench.hex");
+    std::istringstream stream(file);
+    std::vector<legacy::Entry> entries;
+    legacy::parse(stream, entries);
+    std::vector<uint8_t> image = data.getImage(0, byteCount);
+    for (const legacy::Entry & entry : entries)
+    {
+        for (size_t i = 0; i < entry.data.size(); i++)
+        {
+            if (image[entry.address + i] != entry.data[i])
+            {
+                fprintf(stderr, "Mismatch at 0x%x.\n", (unsigned)(entry.address + i));
+                return 1;
+            }
+        }
+    }
+
+    report("legacy stream parser", legacyTime, file.size());
+    report("readFromFile (stream)", streamTime, file.size());
+    report("readFromBuffer", bufferTime, file.size());
+    printf("Speedup of readFromBuffer: %.1fx\n", legacyTime / bufferTime);
+
+    // Write the data the way ActionReadMemory does, with 16-byte entries.
+    IntelHex::Data dump;
+    dump.setImage(0, image);
+    std::vector<legacy::Entry> dumpEntries;
+    for (uint32_t address = 0; address < byteCount; address += 16)
+    {
+        dumpEntries.push_back(legacy::Entry(address, std::vector<uint8_t>(
+            image.begin() + address, image.begin() + address + 16)));
+    }
+
+    std::ostringstream legacyOutput, output;
+    legacy::write(legacyOutput, dumpEntries);
+    dump.writeToFile(output);
+    if (legacyOutput.str() != output.str())
+    {
+        fprintf(stderr, "The writers produced different output.\n");
+        return 1;
+    }
+
+    const char * fileName = "bench_intel_hex.tmp";
+
+    double legacyWriteTime = timeBest([&]()
+    {
+        std::ofstream out(fileName);
+        legacy::write(out, dumpEntries);
+    });
+
+    double writeTime = timeBest([&]()
+    {
+        std::ofstream out(fileName);
+        dump.writeToFile(out);
+    });
+
+    remove(fileName);
+
+    size_t outputSize = output.str().size();
+    report("legacy ostream writer", legacyWriteTime, outputSize);
+    report("writeToFile", writeTime, outputSize);
+    printf("Speedup of writeToFile: %.1fx\n", legacyWriteTime / writeTime);
+    return 0;
+}
@@ -0,0 +1,116 @@
+#include "p-load.h"
+#include "device_monitor.h"
+
+#include <chrono>
+
+void PollingEventSource::waitForArrival(uint32_t maxWaitMs)
+{
+    uint32_t delayMs = std::min<uint32_t>(maxWaitMs, 100);
+    std::this_thread::sleep_for(std::chrono::milliseconds(delayMs));
+}
+
+// udev sends its messages with this header in front of the properties.
+// We only care about the prefix and the offset of the properties.
+static const char udevPrefix[] = "libudev";
+static const size_t udevPropertiesOffsetPosition = 16;
+
+bool ueventIsBootloaderArrival(const char * message, size_t length)
+{
+    size_t offset = 0;
+
+    if (length >= sizeof(udevPrefix) &&
+        memcmp(message, udevPrefix, sizeof(udevPrefix)) == 0)
+    {
+        uint32_t propertiesOffset;
+        if (length < udevPropertiesOffsetPosition + sizeof(propertiesOffset))
+        {
+            return false;
+        }
+        memcpy(&propertiesOffset, message + udevPropertiesOffsetPosition,
+            sizeof(propertiesOffset));
+        offset = propertiesOffset;
+    }
+    else
+    {
+        // The kernel puts a summary like "add@/devices/..." in front of the
+        // properties.  Skip it.
+        offset = strnlen(message, length) + 1;
+    }
+
+    bool actionMatches = false;
+    bool subsystemMatches = false;
+    const PloaderType * type = NULL;
+
+    while (offset < length)
+    {
+        const char * property = message + offset;
+        size_t propertyLength = strnlen(property, length - offset);
+        std::string p(property, propertyLength);
+        offset += propertyLength + 1;
+
+        if (p == "ACTION=add" || p == "ACTION=bind")
+        {
+            actionMatches = true;
+        }
+        else if (p == "SUBSYSTEM=usb")
+        {
+            subsystemMatches = true;
+        }
+        else if (p.compare(0, 8, "PRODUCT=") == 0)
+        {
+            // The format is VENDOR/PRODUCT/BCDDEVICE, in hex.
+            unsigned int vendorId, productId;
+            if (sscanf(p.c_str() + 8, "%x/%x", &vendorId, &productId) == 2)
+            {
+                type = ploaderTypeLookup(vendorId, productId);
+            }
+        }
+    }
+
+    return actionMatches && subsystemMatches && type != NULL;
+}
+
+std::unique_ptr<DeviceEventSource> deviceEventSourceCreate()
+{
+    std::unique_ptr<DeviceEventSource> source;
+#ifdef __linux__
+    // USB events do not tell us anything about simulated devices.
+    if (ploaderBusIsUsb())
+    {
+        source = netlinkEventSourceCreate();
+    }
+#endif
+    if (!source)
+    {
+        source.reset(new PollingEventSource());
+    }
+    return source;
+}
+
+bool DeviceWaitLoop::waitUntil(std::function<bool()> check)
+{
+    auto startTime = std::chrono::steady_clock::now();
+
+    while (1)
+    {
+        if (check())
+        {
+            return true;
+        }
+
+        uint32_t elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - startTime).count();
+        if (elapsed >= timeoutMs)
+        {
+            return false;
+        }
+
+        eventSource->waitForArrival(timeoutMs - elapsed);
+
+        // The previous lists of devices we had are now stale because we
+        // delayed.  Clear them.  (This is our way of telling the device
+        // selector that the program is delaying; the function could have been
+        // named something like "handleDelay" just as well.)
+        selector.clearDeviceLists();
+    }
+}
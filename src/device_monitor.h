@@ -0,0 +1,65 @@
+#pragma once
+
+#include "p-load.h"
+#include "device_selector.h"
+
+#include <functional>
+
+/* A DeviceEventSource lets code that is waiting for a bootloader to appear
+ * sleep until something interesting happens on the USB bus, instead of
+ * re-enumerating all the USB devices at a fixed rate. */
+class DeviceEventSource
+{
+public:
+    virtual ~DeviceEventSource() { }
+
+    /* Blocks until a device that might be one of our bootloaders arrives, the
+     * event source wants us to enumerate the devices again anyway, or maxWaitMs
+     * milliseconds have passed. */
+    virtual void waitForArrival(uint32_t maxWaitMs) = 0;
+};
+
+/* The fallback event source, which just sleeps for 100 ms at a time. */
+class PollingEventSource : public DeviceEventSource
+{
+public:
+    void waitForArrival(uint32_t maxWaitMs) override;
+};
+
+/* Returns true if the specified netlink uevent message (either in the format
+ * sent by the kernel or the one sent by udev) says that a USB device with the
+ * vendor ID and product ID of a known bootloader was added. */
+bool ueventIsBootloaderArrival(const char * message, size_t length);
+
+/* Creates the best event source available on this system, which might be a
+ * PollingEventSource. */
+std::unique_ptr<DeviceEventSource> deviceEventSourceCreate();
+
+#ifdef __linux__
+/* Creates an event source that listens for uevents on a netlink socket.
+ * Returns NULL if the socket could not be opened. */
+std::unique_ptr<DeviceEventSource> netlinkEventSourceCreate();
+#endif
+
+/* Runs the loop that waits for devices to appear: it checks for the devices,
+ * waits for an event, clears the stale device lists in the selector, and
+ * repeats until the check passes or the timeout expires. */
+class DeviceWaitLoop
+{
+public:
+    DeviceWaitLoop(DeviceSelector & selector, uint32_t timeoutMs,
+        std::unique_ptr<DeviceEventSource> eventSource = deviceEventSourceCreate())
+        : selector(selector), timeoutMs(timeoutMs),
+          eventSource(std::move(eventSource))
+    {
+    }
+
+    /* Calls check() after every enumeration until it returns true.  Returns
+     * false if the timeout expires first. */
+    bool waitUntil(std::function<bool()> check);
+
+private:
+    DeviceSelector & selector;
+    uint32_t timeoutMs;
+    std::unique_ptr<DeviceEventSource> eventSource;
+};
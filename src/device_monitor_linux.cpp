@@ -0,0 +1,121 @@
+/* Linux event source for DeviceWaitLoop: listens for USB devices being added
+ * by reading uevents from a netlink socket. */
+
+#include "p-load.h"
+#include "device_monitor.h"
+
+#include <chrono>
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+// Multicast groups for netlink uevents.  The kernel sends its events to group
+// 1, and udev re-sends them to group 2 after it has processed its rules (e.g.
+// set the permissions of the device).  We listen to both, since udev might
+// not be running.
+#define UEVENT_GROUP_KERNEL 1
+#define UEVENT_GROUP_UDEV 2
+
+// Even though we are notified about new devices, we still enumerate devices
+// this often in case an event was lost (e.g. because the socket's buffer
+// overflowed).
+static const uint32_t fallbackPollMs = 1000;
+
+// After a bootloader arrives, it might not be ready to use for a little while,
+// so we enumerate devices frequently during this period.
+static const uint32_t settlingPeriodMs = 1000;
+static const uint32_t settlingPollMs = 20;
+
+class NetlinkEventSource : public DeviceEventSource
+{
+public:
+    explicit NetlinkEventSource(int fd) : fd(fd) { }
+
+    ~NetlinkEventSource()
+    {
+        close(fd);
+    }
+
+    void waitForArrival(uint32_t maxWaitMs) override;
+
+private:
+    // Reads all the pending messages.  Returns true if any of them was
+    // about a bootloader arriving.
+    bool readMessages();
+
+    int fd;
+    std::chrono::steady_clock::time_point settlingEndTime;
+};
+
+std::unique_ptr<DeviceEventSource> netlinkEventSourceCreate()
+{
+    std::unique_ptr<DeviceEventSource> source;
+
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+        NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) { return source; }
+
+    struct sockaddr_nl address;
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = UEVENT_GROUP_KERNEL | UEVENT_GROUP_UDEV;
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        close(fd);
+        return source;
+    }
+
+    source.reset(new NetlinkEventSource(fd));
+    return source;
+}
+
+bool NetlinkEventSource::readMessages()
+{
+    bool arrival = false;
+    char buffer[8192];
+    while (1)
+    {
+        ssize_t length = recv(fd, buffer, sizeof(buffer), 0);
+        if (length < 0)
+        {
+            // EAGAIN means we read everything.  ENOBUFS means some messages
+            // were dropped, so it is worth enumerating devices again.
+            return arrival || errno == ENOBUFS;
+        }
+
+        if (ueventIsBootloaderArrival(buffer, length))
+        {
+            arrival = true;
+        }
+    }
+}
+
+void NetlinkEventSource::waitForArrival(uint32_t maxWaitMs)
+{
+    auto now = std::chrono::steady_clock::now();
+    uint32_t waitMs = now < settlingEndTime ? settlingPollMs : fallbackPollMs;
+    auto endTime = now + std::chrono::milliseconds(std::min(waitMs, maxWaitMs));
+
+    while (now < endTime)
+    {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+            endTime - now).count() + 1;
+        int result = poll(&pfd, 1, timeout);
+        if (result < 0 && errno != EINTR)
+        {
+            // Something is wrong with the socket, so fall back to polling.
+            std::this_thread::sleep_for(endTime - now);
+            return;
+        }
+
+        if (result > 0 && readMessages())
+        {
+            settlingEndTime = std::chrono::steady_clock::now() +
+                std::chrono::milliseconds(settlingPeriodMs);
+            return;
+        }
+
+        now = std::chrono::steady_clock::now();
+    }
+}
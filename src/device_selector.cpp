@@ -3,10 +3,12 @@
 
 DeviceSelector::DeviceSelector()
 {
+    appSelected = false;
     serialNumberSpecified = false;
     typesSpecified = false;
     firmwareDataSpecified = false;
     userTypeSpecified = false;
+    snapshotInitialized = false;
     appListInitialized = false;
     bootloaderListInitialized = false;
 }
@@ -101,15 +103,29 @@ bool DeviceSelector::serialNumberWasSpecified() const
     return serialNumberSpecified;
 }
 
+bool DeviceSelector::userTypeWasSpecified() const
+{
+    return userTypeSpecified;
+}
+
 void DeviceSelector::clearDeviceLists()
 {
     assert(!bootloader);
+    snapshotInitialized = false;
+    snapshot = DeviceSnapshot();
     appListInitialized = false;
     appList.clear();
     bootloaderListInitialized = false;
     bootloaderList.clear();
 }
 
+void DeviceSelector::useSnapshot(const DeviceSnapshot & devices)
+{
+    clearDeviceLists();
+    snapshot = devices;
+    snapshotInitialized = true;
+}
+
 template<typename T>
 static std::vector<T> filterBySerialNumber(
     const std::vector<T> & in, std::string serialNumber)
@@ -146,12 +162,22 @@ static std::vector<L> filterByType(
     return out;
 }
 
+const DeviceSnapshot & DeviceSelector::getSnapshot()
+{
+    if (!snapshotInitialized)
+    {
+        snapshot = ploaderListDevices();
+        snapshotInitialized = true;
+    }
+    return snapshot;
+}
+
 std::vector<PloaderAppInstance> DeviceSelector::listApps()
 {
     if (!appListInitialized)
     {
         appListInitialized = true;
-        appList = ploaderListApps();
+        appList = getSnapshot().apps;
 
         if (serialNumberSpecified)
         {
@@ -173,7 +199,7 @@ std::vector<PloaderInstance> DeviceSelector::listBootloaders()
         assert(!bootloader);
 
         bootloaderListInitialized = true;
-        bootloaderList = ploaderListBootloaders();
+        bootloaderList = getSnapshot().bootloaders;
 
         if (serialNumberSpecified)
         {
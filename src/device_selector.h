@@ -17,6 +17,10 @@ public:
 
     void clearDeviceLists();
 
+    /* Makes the selector use the specified devices, instead of enumerating
+     * the devices itself. */
+    void useSnapshot(const DeviceSnapshot &);
+
     std::vector<PloaderAppInstance> listApps();
     std::vector<PloaderInstance> listBootloaders();
 
@@ -24,6 +28,7 @@ public:
     PloaderInstance selectBootloader();
 
     bool serialNumberWasSpecified() const;
+    bool userTypeWasSpecified() const;
 
     std::string deviceNotFoundMessage() const;
     ExceptionWithExitCode deviceNotFoundError() const;
@@ -44,6 +49,12 @@ private:
     std::vector<PloaderAppType> appTypes;
     std::vector<PloaderType> bootloaderTypes;
 
+    // All the devices found by the last enumeration.  Both lists below are
+    // built from this, so we only enumerate once until the next delay.
+    const DeviceSnapshot & getSnapshot();
+    bool snapshotInitialized;
+    DeviceSnapshot snapshot;
+
     bool appListInitialized;
     std::vector<PloaderAppInstance> appList;
 
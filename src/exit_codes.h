@@ -2,11 +2,9 @@
 
 #include "p-load.h"
 
-// Process exit codes:
-#define PLOAD_ERROR_BAD_ARGS 1
-#define PLOAD_ERROR_OPERATION_FAILED 2
-#define PLOAD_ERROR_DEVICE_NOT_FOUND 3
-#define PLOAD_ERROR_DEVICE_MULTIPLE_FOUND 4
+// The process exit codes are the PLOAD_ERROR_* codes of the C API, so they
+// are only defined there.
+#include "libp-load.h"
 
 class ExceptionWithExitCode : public std::exception
 {
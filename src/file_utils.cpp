@@ -1,5 +1,13 @@
 #include "file_utils.h"
 #include <stdexcept>
+#include <cerrno>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 namespace
 {
@@ -8,16 +16,16 @@ namespace
     };
 }
 
-std::shared_ptr<std::istream> openFileOrPipeInput(std::string fileName)
+std::shared_ptr<std::ostream> openFileOrPipeOutput(std::string fileName)
 {
-    std::shared_ptr<std::istream> file;
+    std::shared_ptr<std::ostream> file;
     if (fileName == "-")
     {
-        file.reset(&std::cin, noop());
+        file.reset(&std::cout, noop());
     }
     else
     {
-        std::ifstream * diskFile = new std::ifstream();
+        std::ofstream * diskFile = new std::ofstream();
         file.reset(diskFile);
         diskFile->open(fileName);
         if (!*diskFile)
@@ -29,23 +37,101 @@ std::shared_ptr<std::istream> openFileOrPipeInput(std::string fileName)
     return file;
 }
 
-std::shared_ptr<std::ostream> openFileOrPipeOutput(std::string fileName)
+uint64_t hashBytes(const void * data, size_t size, uint64_t hash)
+{
+    const uint8_t * bytes = (const uint8_t *)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ bytes[i]) * 0x100000001B3;
+    }
+    return hash;
+}
+
+static std::runtime_error fileError(std::string fileName)
+{
+    int error_code = errno;
+    return std::runtime_error(fileName + ": " + strerror(error_code) + ".");
+}
+
+// Appends everything from a stream to a string.
+static void readStream(std::istream & stream, std::string & buffer)
+{
+    char chunk[0x10000];
+    while (stream.read(chunk, sizeof(chunk)) || stream.gcount())
+    {
+        buffer.append(chunk, stream.gcount());
+    }
+}
+
+FileContents::FileContents(std::string fileName)
+    : mappedData(NULL), mappedSize(0)
 {
-    std::shared_ptr<std::ostream> file;
     if (fileName == "-")
     {
-        file.reset(&std::cout, noop());
+        readStream(std::cin, buffer);
+        if (std::cin.bad())
+        {
+            throw std::runtime_error("Error reading from standard input.");
+        }
+        return;
     }
-    else
+
+#ifndef _WIN32
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0)
     {
-        std::ofstream * diskFile = new std::ofstream();
-        file.reset(diskFile);
-        diskFile->open(fileName);
-        if (!*diskFile)
+        throw fileError(fileName);
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+    {
+        void * p = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED)
         {
-            int error_code = errno;
-            throw std::runtime_error(fileName + ": " + strerror(error_code) + ".");
+            mappedData = (const char *)p;
+            mappedSize = info.st_size;
+            close(fd);
+            return;
         }
     }
-    return file;
+
+    // The file cannot be mapped (e.g. it is a named pipe), so read it.
+    char chunk[0x10000];
+    while (1)
+    {
+        ssize_t count = read(fd, chunk, sizeof(chunk));
+        if (count < 0 && errno == EINTR) { continue; }
+        if (count < 0)
+        {
+            std::runtime_error error = fileError(fileName);
+            close(fd);
+            throw error;
+        }
+        if (count == 0) { break; }
+        buffer.append(chunk, count);
+    }
+    close(fd);
+#else
+    std::ifstream file(fileName, std::ios::binary);
+    if (!file)
+    {
+        throw fileError(fileName);
+    }
+    readStream(file, buffer);
+    if (file.bad())
+    {
+        throw std::runtime_error(fileName + ": error reading.");
+    }
+#endif
+}
+
+FileContents::~FileContents()
+{
+#ifndef _WIN32
+    if (mappedData)
+    {
+        munmap((void *)mappedData, mappedSize);
+    }
+#endif
 }
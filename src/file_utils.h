@@ -4,6 +4,33 @@
 #include <iostream>
 #include <fstream>
 #include <cstring>
+#include <string>
+#include <cstdint>
 
-std::shared_ptr<std::istream> openFileOrPipeInput(std::string fileName);
 std::shared_ptr<std::ostream> openFileOrPipeOutput(std::string fileName);
+
+/* Returns the 64-bit FNV-1a hash of the data.  To hash several pieces of data
+ * together, pass the hash of the previous pieces as the last argument. */
+uint64_t hashBytes(const void * data, size_t size,
+    uint64_t hash = 0xCBF29CE484222325);
+
+/* Holds the entire contents of a file, or of the standard input if the file
+ * name is "-", in memory.  Regular files are memory-mapped where possible
+ * instead of being copied into a buffer. */
+class FileContents
+{
+public:
+    explicit FileContents(std::string fileName);
+    ~FileContents();
+
+    const char * data() const { return mappedData ? mappedData : buffer.data(); }
+    size_t size() const { return mappedData ? mappedSize : buffer.size(); }
+
+private:
+    FileContents(const FileContents &);
+    FileContents & operator=(const FileContents &);
+
+    const char * mappedData;
+    size_t mappedSize;
+    std::string buffer;
+};
@@ -1,50 +1,9 @@
 #include "p-load.h"
+#include "hex_digits.h"
 #include <tinyxml2.h>
 
 #define USB_VENDOR_ID_POLOLU 0x1FFB
 
-static int hexDigitValue(unsigned char c)
-{
-    if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
-    if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
-    if (c >= '0' && c <= '9') { return c - '0'; }
-    return -1;
-}
-
-static uint8_t readHexByte(std::istream & s)
-{
-    std::istream::sentry sentry(s, true);
-    if (sentry)
-    {
-        char c1 = 0, c2 = 0;
-        s.get(c1);
-        s.get(c2);
-
-        if (s.fail())
-        {
-            if (s.eof())
-            {
-                throw std::runtime_error("Unexpected end of line.");
-            }
-            else
-            {
-                throw std::runtime_error("Failed to read hex digit.");
-            }
-        }
-
-        int v1 = hexDigitValue(c1);
-        int v2 = hexDigitValue(c2);
-
-        if (v1 < 0 || v2 < 0)
-        {
-            throw std::runtime_error("Invalid hex digit.");
-        }
-
-        return v1 * 16 + v2;
-    }
-    return 0;
-}
-
 static std::vector<std::string> split(const std::string & str, char delimiter)
 {
     std::vector<std::string> r;
@@ -97,6 +56,20 @@ static bool niceStrToULong(const char * cstr, unsigned long * out)
     return true;
 }
 
+// Counts the child elements with the specified name so we can reserve space
+// for them before processing them.
+static size_t countChildElements(const tinyxml2::XMLElement * element,
+    const char * name)
+{
+    size_t count = 0;
+    for (const tinyxml2::XMLElement * child = element->FirstChildElement(name);
+         child != NULL; child = child->NextSiblingElement(name))
+    {
+        count++;
+    }
+    return count;
+}
+
 static FirmwareArchive::Block processXmlBlock(
     const tinyxml2::XMLElement * element)
 {
@@ -124,20 +97,23 @@ static FirmwareArchive::Block processXmlBlock(
         throw std::runtime_error("A block has missing or invalid contents.");
     }
 
-    std::string contents(contentsCStr);
-
-    if ((contents.size() % 2) != 0)
+    size_t length = strlen(contentsCStr);
+    if ((length % 2) != 0)
     {
         throw std::runtime_error("A block has an odd number of characters.");
     }
 
-    uint32_t byteCount = contents.size() / 2;
-
-    std::istringstream stream(contents);
+    // Decode the hex digits straight into the block.  Whitespace is not
+    // allowed in the contents, so every pair of characters is one byte.
+    size_t byteCount = length / 2;
     block.data.resize(byteCount);
-    for (uint32_t i = 0; i < byteCount; i++)
+    uint8_t * data = block.data.data();
+    for (size_t i = 0; i < byteCount; i++)
     {
-        block.data[i] = readHexByte(stream);
+        if (!decodeHexByte(contentsCStr + 2 * i, data[i]))
+        {
+            throw std::runtime_error("Invalid hex digit.");
+        }
     }
 
     return block;
@@ -192,6 +168,7 @@ static FirmwareArchive::Image processXmlFirmwareImage(
     }
 
     // Process the blocks.
+    image.blocks.reserve(countChildElements(element, "Block"));
     for (const tinyxml2::XMLNode * node = element->FirstChild();
          node != NULL; node = node->NextSibling())
     {
@@ -207,6 +184,12 @@ static FirmwareArchive::Image processXmlFirmwareImage(
         }
 
         image.blocks.push_back(processXmlBlock(element));
+
+        if (image.uploadType == UPLOAD_TYPE_PLAIN)
+        {
+            const FirmwareArchive::Block & block = image.blocks.back();
+            image.plainImage.write(block.address, block.data.data(), block.data.size());
+        }
     }
 
     if (image.blocks.empty())
@@ -217,11 +200,12 @@ static FirmwareArchive::Image processXmlFirmwareImage(
     return image;
 }
 
-void FirmwareArchive::Data::processXml(std::string string)
+void FirmwareArchive::Data::processXml(const char * buffer, size_t size)
 {
-    // Parse the string as XML.
+    // Parse the buffer as XML.  TinyXML2 makes its own copy of the buffer to
+    // parse in place, so we can pass it a mapped file directly.
     tinyxml2::XMLDocument doc;
-    doc.Parse(string.c_str(), string.size());
+    doc.Parse(buffer, size);
     throwIfError(doc);
 
     // Check the FirmwareArchive element.
@@ -255,6 +239,7 @@ void FirmwareArchive::Data::processXml(std::string string)
     if (name != NULL) { this->name = name; }
 
     // Process the images.
+    images.reserve(countChildElements(root, "FirmwareImage"));
     for (const tinyxml2::XMLNode * node = root->FirstChild();
          node != NULL; node = node->NextSibling())
     {
@@ -282,16 +267,26 @@ void FirmwareArchive::Data::readFromFile(std::istream & file,
     const char * fileName)
 {
     // Read the entire file into a string.
-    std::stringstream buffer;
-    buffer << file.rdbuf();
-    if (file.fail())
+    std::string buffer;
+    char chunk[0x10000];
+    while (file.read(chunk, sizeof(chunk)) || file.gcount())
+    {
+        buffer.append(chunk, file.gcount());
+    }
+    if (file.bad())
     {
         throw std::runtime_error(std::string(fileName) + ": error reading.");
     }
 
+    readFromBuffer(buffer.data(), buffer.size(), fileName);
+}
+
+void FirmwareArchive::Data::readFromBuffer(const char * buffer, size_t size,
+    const char * fileName)
+{
     try
     {
-        processXml(buffer.str());
+        processXml(buffer, size);
     }
     catch(const std::runtime_error & e)
     {
@@ -5,6 +5,8 @@
 #include <iostream>
 #include <cstdint>
 #include <cassert>
+#include <stdexcept>
+#include "sparse_image.h"
 
 // Class for reading Firmware Archive (.fmi) files.
 namespace FirmwareArchive
@@ -23,6 +25,11 @@ namespace FirmwareArchive
         uint16_t usbProductId;
         uint16_t uploadType;
         std::vector<Block> blocks;
+
+        // The contents of the blocks as a sparse image.  This is only filled
+        // in for images with the plain upload type, because the data in the
+        // other types is encrypted.
+        SparseImage plainImage;
     };
 
     class Data
@@ -30,6 +37,9 @@ namespace FirmwareArchive
     public:
         void readFromFile(std::istream & file, const char * fileName);
 
+        void readFromBuffer(const char * buffer, size_t size,
+            const char * fileName);
+
         operator bool() const
         {
             return !images.empty();
@@ -69,7 +79,7 @@ namespace FirmwareArchive
         std::vector<Image> images;
 
     private:
-        void processXml(std::string s);
+        void processXml(const char * buffer, size_t size);
     };
 }
 
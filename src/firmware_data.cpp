@@ -13,36 +13,32 @@ FirmwareData::operator bool() const
 }
 
 void FirmwareData::readFromFile(const char * fileName)
+{
+    FileContents contents(fileName);
+    readFromBuffer(contents.data(), contents.size(), fileName);
+}
+
+void FirmwareData::readFromBuffer(const char * buffer, size_t size,
+    const char * fileName)
 {
     assert(!*this);
 
     std::string fileNameStr(fileName);
 
-    auto filePtr = openFileOrPipeInput(fileNameStr);
-    std::istream & file = *filePtr;
-
-    // Get the first character so we can figure out what kind of file this is.
-    char first_char;
-    file.get(first_char);
-    if (file.fail())
+    // Look at the first character so we can figure out what kind of file this
+    // is.
+    if (size == 0)
     {
         throw std::runtime_error(fileNameStr + ": Failed to read first character.");
     }
 
-    // Put that character back in the buffer.
-    file.unget();
-    if (file.fail())
-    {
-        throw std::runtime_error(fileNameStr + ": Failed to unget character from file.");
-    }
-
-    if (first_char == ':')
+    if (buffer[0] == ':')
     {
-        hexData.readFromFile(file, fileName);
+        hexData.readFromBuffer(buffer, size, fileName);
     }
     else
     {
-        firmwareArchiveData.readFromFile(file, fileName);
+        firmwareArchiveData.readFromBuffer(buffer, size, fileName);
     }
 
     if (!*this)
@@ -106,13 +102,12 @@ void FirmwareData::writeToBootloader(PloaderHandle & handle,
         if (type.memorySetIncludesEeprom(memorySet))
         {
             MemoryImage eeprom = hexData.getImage(type.eepromAddressHexFile, type.eepromSize);
-            handle.writeEeprom(&eeprom[0]);
+            handle.writeEepromChanges(&eeprom[0]);
         }
 
         if (type.memorySetIncludesFlash(memorySet))
         {
-            MemoryImage flash = hexData.getImage(type.appAddress, type.appSize);
-            handle.writeFlash(&flash[0]);
+            handle.writeFlash(hexData.getSparseImage());
         }
     }
     else if (firmwareArchiveData)
@@ -126,3 +121,187 @@ void FirmwareData::writeToBootloader(PloaderHandle & handle,
         noDataError();
     }
 }
+
+bool FirmwareData::canCompareWithBootloader(const PloaderType & type,
+    MemorySet memorySet) const
+{
+    if (hexData)
+    {
+        if (type.memorySetIncludesFlash(memorySet) && !type.supportsFlashReading)
+        {
+            return false;
+        }
+
+        if (type.memorySetIncludesEeprom(memorySet) && !type.supportsEepromAccess)
+        {
+            return false;
+        }
+
+        return true;
+    }
+    else if (firmwareArchiveData)
+    {
+        const FirmwareArchive::Image & image = firmwareArchiveData.findImage(
+            type.usbVendorId, type.usbProductId);
+        return image.uploadType == UPLOAD_TYPE_PLAIN && type.supportsFlashReading;
+    }
+    else
+    {
+        noDataError();
+        return false;
+    }
+}
+
+// Compares the expected and actual contents of a memory one block at a time,
+// and records the blocks that differ.
+static void compareBlocks(const MemoryImage & expected, const MemoryImage & actual,
+    uint32_t startAddress, uint32_t blockSize, bool eeprom,
+    std::vector<FirmwareDifference> & differences)
+{
+    assert(expected.size() == actual.size());
+
+    for (size_t offset = 0; offset < expected.size(); offset += blockSize)
+    {
+        size_t size = std::min<size_t>(blockSize, expected.size() - offset);
+        if (memcmp(&expected[offset], &actual[offset], size) != 0)
+        {
+            FirmwareDifference difference;
+            difference.eeprom = eeprom;
+            difference.address = startAddress + offset;
+            differences.push_back(difference);
+        }
+    }
+}
+
+std::vector<FirmwareDifference> FirmwareData::compareWithBootloader(
+    PloaderHandle & handle, MemorySet memorySet, bool verify) const
+{
+    const PloaderType & type = handle.type;
+    assert(canCompareWithBootloader(type, memorySet));
+
+    std::vector<FirmwareDifference> differences;
+
+    MemoryImage expectedFlash;
+    bool compareFlash = false;
+    bool compareEeprom = false;
+
+    if (hexData)
+    {
+        if (type.memorySetIncludesFlash(memorySet))
+        {
+            expectedFlash = hexData.getImage(type.appAddress, type.appSize);
+            compareFlash = true;
+        }
+        compareEeprom = type.memorySetIncludesEeprom(memorySet);
+    }
+    else if (firmwareArchiveData)
+    {
+        // A plain image gets written on top of erased flash.
+        const FirmwareArchive::Image & image = firmwareArchiveData.findImage(
+            type.usbVendorId, type.usbProductId);
+        expectedFlash = image.plainImage.read(type.appAddress, type.appSize);
+        compareFlash = true;
+    }
+    else
+    {
+        noDataError();
+    }
+
+    if (compareEeprom)
+    {
+        MemoryImage expected = hexData.getImage(type.eepromAddressHexFile, type.eepromSize);
+        MemoryImage actual(type.eepromSize);
+        handle.readEeprom(&actual[0],
+            verify ? "Verifying EEPROM..." : "Reading EEPROM...");
+        compareBlocks(expected, actual, type.eepromAddress,
+            PloaderHandle::eepromBlockSize, true, differences);
+    }
+
+    if (compareFlash)
+    {
+        MemoryImage actual(type.appSize);
+        handle.readFlash(&actual[0],
+            verify ? "Verifying flash..." : "Reading flash...");
+        compareBlocks(expectedFlash, actual, type.appAddress,
+            type.writeBlockSize, false, differences);
+    }
+
+    return differences;
+}
+
+void FirmwareData::verifyWithBootloader(PloaderHandle & handle,
+    MemorySet memorySet) const
+{
+    std::vector<FirmwareDifference> differences =
+        compareWithBootloader(handle, memorySet, true);
+
+    if (differences.empty())
+    {
+        handle.reportStatus("Verified.");
+        return;
+    }
+
+    std::ostringstream message;
+    message << "Verification failed.  " << differences.size()
+            << " block(s) differ:";
+    message << std::hex << std::uppercase << std::setfill('0');
+    for (const FirmwareDifference & difference : differences)
+    {
+        message << "\n  " << (difference.eeprom ? "EEPROM" : "flash")
+                << " 0x" << std::setw(4) << difference.address;
+    }
+    throw ExceptionWithExitCode(PLOAD_ERROR_VERIFICATION_FAILED, message.str());
+}
+
+std::string FirmwareData::contentHash(const PloaderType & type,
+    MemorySet memorySet) const
+{
+    // Each piece is preceded by a letter saying what it is, so that the same
+    // bytes in flash and in EEPROM give different hashes.
+    uint64_t hash = hashBytes(NULL, 0);
+    if (hexData)
+    {
+        if (type.memorySetIncludesFlash(memorySet))
+        {
+            MemoryImage flash = hexData.getImage(type.appAddress, type.appSize);
+            hash = hashBytes("F", 1, hash);
+            hash = hashBytes(&flash[0], flash.size(), hash);
+        }
+        if (type.memorySetIncludesEeprom(memorySet))
+        {
+            MemoryImage eeprom = hexData.getImage(type.eepromAddressHexFile, type.eepromSize);
+            hash = hashBytes("E", 1, hash);
+            hash = hashBytes(&eeprom[0], eeprom.size(), hash);
+        }
+    }
+    else if (firmwareArchiveData)
+    {
+        const FirmwareArchive::Image & image = firmwareArchiveData.findImage(
+            type.usbVendorId, type.usbProductId);
+        hash = hashBytes("I", 1, hash);
+        hash = hashBytes(&image.uploadType, sizeof(image.uploadType), hash);
+        for (const FirmwareArchive::Block & block : image.blocks)
+        {
+            hash = hashBytes(&block.address, sizeof(block.address), hash);
+            hash = hashBytes(block.data.data(), block.data.size(), hash);
+        }
+    }
+    else
+    {
+        noDataError();
+    }
+
+    char digits[17];
+    snprintf(digits, sizeof(digits), "%016llX", (unsigned long long)hash);
+    return digits;
+}
+
+uint16_t FirmwareData::uploadType(const PloaderType & type) const
+{
+    if (firmwareArchiveData)
+    {
+        return firmwareArchiveData.findImage(
+            type.usbVendorId, type.usbProductId).uploadType;
+    }
+    return UPLOAD_TYPE_PLAIN;
+}
@@ -5,6 +5,16 @@
 #include "ploader.h"
 #include "firmware_archive.h"
 
+// Describes a block of memory on a device whose contents do not match the
+// firmware data.  The address is in the address space used by the bootloader
+// for that memory.
+class FirmwareDifference
+{
+public:
+    bool eeprom;
+    uint32_t address;
+};
+
 // FirmwareData abstracts away the differences between different types of
 // firmware files and how they are written to the bootloader.  It also knows how
 // to detect which type of file has been given.
@@ -13,12 +23,38 @@ class FirmwareData
 public:
     void readFromFile(const char * fileName);
 
+    /** Reads the data from a file that is already in memory.  The file name is
+     * only used in error messages. */
+    void readFromBuffer(const char * buffer, size_t size, const char * fileName);
+
     /** Raises an exception if the specified memory sets from this data
      * cannot be written to the specified type of bootloader. */
     void ensureBootloaderCompatibility(const PloaderType &, MemorySet) const;
 
     void writeToBootloader(PloaderHandle &, MemorySet) const;
 
+    /** Returns true if the specified memories can be read back from the
+     * bootloader and compared to this data.  This requires the data to be
+     * plain (not encrypted) and the bootloader to support reading. */
+    bool canCompareWithBootloader(const PloaderType &, MemorySet) const;
+
+    /** Reads the specified memories from the bootloader and returns the blocks
+     * that do not match what writeToBootloader would have written.  If verify
+     * is true, the progress is reported as verification instead of reading. */
+    std::vector<FirmwareDifference> compareWithBootloader(
+        PloaderHandle &, MemorySet, bool verify = false) const;
+
+    /** Reads back the specified memories after writing this data to them,
+     * and throws an exception if they do not match. */
+    void verifyWithBootloader(PloaderHandle &, MemorySet) const;
+
+    /** Returns a hash of what writeToBootloader would write to the specified
+     * memories of the specified type of bootloader, as 16 hex digits. */
+    std::string contentHash(const PloaderType &, MemorySet) const;
+
+    /** Returns the upload type that writeToBootloader would use. */
+    uint16_t uploadType(const PloaderType &) const;
+
     operator bool() const;
 
     IntelHex::Data hexData;
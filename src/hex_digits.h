@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdint>
+
+/* Table-driven conversion of ASCII hex digits, shared by the HEX and FMI
+ * parsers.  The table maps each character to the value of the hex digit, or to
+ * 0xFF if the character is not a hex digit. */
+extern const uint8_t hexDigitValues[256];
+
+/* Decodes the two hex digits at s into a byte.  Returns false if either of
+ * them is not a hex digit. */
+inline bool decodeHexByte(const char * s, uint8_t & value)
+{
+    uint8_t high = hexDigitValues[(uint8_t)s[0]];
+    uint8_t low = hexDigitValues[(uint8_t)s[1]];
+    value = high << 4 | low;
+    return (high | low) < 16;
+}
@@ -3,7 +3,9 @@
  */
 
 #include "intel_hex.h"
+#include "hex_digits.h"
 #include <cassert>
+#include <cstring>
 #include <sstream>
 #include <iomanip>
 #include <algorithm>
@@ -12,97 +14,76 @@
 
 using namespace IntelHex;
 
-static int hexDigitValue(unsigned char c)
+// Reads hex bytes from one line of a HEX file.
+class LineReader
 {
-    if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
-    if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
-    if (c >= '0' && c <= '9') { return c - '0'; }
-    return -1;
-}
+public:
+    LineReader(const char * p, const char * end) : p(p), end(end) { }
 
-static uint8_t readHexByte(std::istream & s)
-{
-    std::istream::sentry sentry(s, true);
-    if (sentry)
+    uint8_t readByte()
     {
-        char c1 = 0, c2 = 0;
-        s.get(c1);
-        s.get(c2);
-
-        if (s.fail())
+        if (end - p < 2)
         {
-            if (s.eof())
-            {
-                throw std::runtime_error("Unexpected end of line.");
-            }
-            else
-            {
-                throw std::runtime_error("Failed to read hex digit.");
-            }
+            throw std::runtime_error("Unexpected end of line.");
         }
-
-        int v1 = hexDigitValue(c1);
-        int v2 = hexDigitValue(c2);
-
-        if (v1 < 0 || v2 < 0)
+        uint8_t value;
+        if (!decodeHexByte(p, value))
         {
             throw std::runtime_error("Invalid hex digit.");
         }
-
-        return v1 * 16 + v2;
+        p += 2;
+        return value;
     }
-    return 0;
-}
 
-static uint16_t readHexShort(std::istream & s)
-{
-    uint16_t r = readHexByte(s) << 8;
-    return r + readHexByte(s);
-}
+    uint16_t readShort()
+    {
+        uint16_t r = readByte() << 8;
+        return r + readByte();
+    }
 
-// Returns true if the line indicates the HEX file is done.
-static void processLine(std::istream & file,
-    std::vector<IntelHex::Entry> & entries,
-    uint16_t & addressHigh,
-    bool & done)
-{
-    std::string lineString;
-    std::getline(file, lineString);
-    if (file.fail())
+    bool atEnd() const
     {
-        if (file.eof())
-        {
-            throw std::runtime_error("Unexpected end of file.");
-        }
-        else
-        {
-            throw std::runtime_error("Failed to read HEX file line.");
-        }
+        return p == end;
     }
 
-    std::istringstream lineStream(lineString);
+private:
+    const char * p;
+    const char * end;
+};
+
+// Processes one line of a HEX file, not including the newline character.
+// Data records are written to the image.  Returns true if the line indicates
+// the HEX file is done.
+static bool processLine(const char * line, const char * lineEnd,
+    SparseImage & image,
+    uint16_t & addressHigh)
+{
+    // Ignore carriage returns at the end of the line.
+    while (lineEnd > line && lineEnd[-1] == '\r') { lineEnd--; }
 
-    char start;
-    lineStream.get(start);
-    if (start != ':')
+    // Blank lines are rejected like any other line that does not start with
+    // a colon.
+    if (line == lineEnd || line[0] != ':')
     {
         throw std::runtime_error("Hex line does not start with colon (:).");
     }
 
+    LineReader reader(line + 1, lineEnd);
+
     // Read the indentifying information of the line.
-    uint8_t byteCount = readHexByte(lineStream);
-    uint16_t addressLow = readHexShort(lineStream);
-    uint8_t recordType = readHexByte(lineStream);
+    uint8_t byteCount = reader.readByte();
+    uint16_t addressLow = reader.readShort();
+    uint8_t recordType = reader.readByte();
 
     // Read the data
-    std::vector<uint8_t> data(byteCount);
+    uint8_t data[0xFF];
     for(uint32_t i = 0; i < byteCount; i++)
     {
-        data[i] = readHexByte(lineStream);
+        data[i] = reader.readByte();
     }
 
     // Read the checksum.
-    uint8_t checksum = readHexByte(lineStream);
+    uint8_t checksum = reader.readByte();
 
     // Check the checksum.
     uint8_t sum = byteCount + (addressLow & 0xFF) + (addressLow >> 8) + recordType;
@@ -121,10 +102,8 @@ static void processLine(std::istream & file,
         throw std::runtime_error(message.str());
     }
 
-    // Check for extra stuff at the end of the line, ignoring carriage returns.
-    int extra;
-    do { extra = lineStream.get(); } while (extra == '\r');
-    if (extra != EOF)
+    // Check for extra stuff at the end of the line.
+    if (!reader.atEnd())
     {
         throw std::runtime_error("Extra data after checksum.");
     }
@@ -141,7 +120,7 @@ static void processLine(std::istream & file,
                 "wrong number of bytes (expected 2).");
         }
         addressHigh = (data[0] << 8) + data[1];
-        break;
+        return false;
 
     case 2:  // Extended Segment Address Record (basically sets bits 4-20 of the address)
     case 5:  // Start Linear Address Record (sets a 32-bit address)
@@ -150,21 +129,20 @@ static void processLine(std::istream & file,
     case 0:  // Data record
     {
         uint32_t address = addressLow + (addressHigh << 16);
-        entries.push_back(Entry(address, data));
-        break;
+        image.write(address, data, byteCount);
+        return false;
     }
 
     case 3: // Start Segment Address Record (specific to 80x86 processors)
         // Ignore this type.
-        break;
+        return false;
 
     case 1: // End of File record
-        done = true;
-        break;
+        return true;
     }
 }
 
-void IntelHex::Data::readFromFile(std::istream & file,
+void IntelHex::Data::readFromBuffer(const char * buffer, size_t size,
     const char * fileName, uint32_t * lineNumber)
 {
     // Assume the high 16 bits of the address are zero initially.
@@ -178,14 +156,27 @@ void IntelHex::Data::readFromFile(std::istream & file,
         lineNumber = &internalLineNumber;
     }
 
+    const char * p = buffer;
+    const char * end = buffer + size;
+
     try
     {
         while(1)
         {
             (*lineNumber)++;
-            bool done = false;
-            processLine(file, entries, addressHigh, done);
+
+            if (p == end)
+            {
+                throw std::runtime_error("Unexpected end of file.");
+            }
+
+            const char * lineEnd = (const char *)memchr(p, '\n', end - p);
+            if (lineEnd == NULL) { lineEnd = end; }
+
+            bool done = processLine(p, lineEnd, image, addressHigh);
             if (done) { break; }
+
+            p = lineEnd == end ? end : lineEnd + 1;
         }
     }
     catch(const std::runtime_error & e)
@@ -197,95 +188,128 @@ void IntelHex::Data::readFromFile(std::istream & file,
     }
 }
 
-std::vector<uint8_t> IntelHex::Data::getImage(uint32_t startAddress, uint32_t size) const
+void IntelHex::Data::readFromFile(std::istream & file,
+    const char * fileName, uint32_t * lineNumber)
 {
-    // Initialize the image to have all bytes set to 0xFF.
-    std::vector<uint8_t> image(size, 0xFF);
-
-    for (const Entry & entry : entries)
+    std::string buffer;
+    char chunk[0x10000];
+    while (file.read(chunk, sizeof(chunk)) || file.gcount())
     {
-        uint32_t start = std::max(startAddress, entry.address);
-        uint32_t end = std::min(startAddress + size,
-          (uint32_t)(entry.address + entry.data.size()));
-        for(uint32_t a = start; a < end; a++)
-        {
-            image[a - startAddress] = entry.data[a - entry.address];
-        }
+        buffer.append(chunk, file.gcount());
+    }
+    if (file.bad())
+    {
+        throw std::runtime_error(std::string(fileName) + ": error reading.");
     }
 
-    return image;
+    readFromBuffer(buffer.data(), buffer.size(), fileName, lineNumber);
 }
 
-void IntelHex::Data::setImage(uint32_t startAddress,
-    std::vector<uint8_t> image, const uint32_t blockSize)
+std::vector<uint8_t> IntelHex::Data::getImage(uint32_t startAddress, uint32_t size) const
 {
-    const uint32_t endAddress = startAddress + image.size();
+    return image.read(startAddress, size);
+}
 
-    // The next address to write to.
-    uint32_t address = startAddress;
+void IntelHex::Data::setImage(uint32_t startAddress, std::vector<uint8_t> data)
+{
+    image.write(startAddress, std::move(data));
+}
 
-    while(address < endAddress)
+// Formats HEX file records into a character buffer, so that the whole file
+// can be written at once instead of one formatted field at a time.
+class HexWriter
+{
+public:
+    explicit HexWriter(size_t capacity)
     {
-        uint32_t entrySize = blockSize;
-        if (address + entrySize > endAddress)
-        {
-            entrySize = endAddress - address;
-        }
+        buffer.reserve(capacity);
+    }
+
+    void writeLine(uint8_t recordType, uint16_t addressLow,
+        const uint8_t * data, size_t size)
+    {
+        assert(size <= 0xFF);
 
-        std::vector<uint8_t> data(entrySize);
-        for (uint32_t i = 0; i < entrySize; i++)
+        buffer += ':';
+        writeByte(size);
+        writeByte(addressLow >> 8);
+        writeByte(addressLow);
+        writeByte(recordType);
+
+        uint8_t sum = size + (addressLow >> 8) + addressLow + recordType;
+        for (size_t i = 0; i < size; i++)
         {
-            data[i] = image[address - startAddress + i];
+            writeByte(data[i]);
+            sum += data[i];
         }
 
-        entries.push_back(Entry(address, data));
-        address += entrySize;
-    }
-}
-
-static void writeHexLine(std::ostream & file, uint8_t recordType,
-    uint16_t addressLow, const std::vector<uint8_t> & data)
-{
-    assert(data.size() <= 0xFF);
+        uint8_t checksum = -sum;
+        writeByte(checksum);
 
-    file << ':';
-    file << std::setw(2) << data.size();
-    file << std::setw(4) << addressLow;
-    file << std::setw(2) << (unsigned int)recordType;
+        buffer += '\n';
+    }
 
-    uint8_t sum = data.size() + (addressLow >> 8) + addressLow + recordType;
-    for(uint8_t dataByte : data)
+    // The number of characters needed for a line with this much data.
+    static size_t lineLength(size_t size)
     {
-        file << std::setw(2) << (unsigned int)dataByte;
-        sum += dataByte;
+        return 1 + (4 + size + 1) * 2 + 1;
     }
 
-    uint8_t checksum = -sum;
-    file << std::setw(2) << (unsigned int)checksum;
+    std::string buffer;
 
-    file << std::endl;
-}
+private:
+    void writeByte(uint8_t b)
+    {
+        static const char digits[] = "0123456789ABCDEF";
+        char hex[2] = { digits[b >> 4], digits[b & 0xF] };
+        buffer.append(hex, 2);
+    }
+};
 
 void IntelHex::Data::writeToFile(std::ostream & file) const
 {
-    uint32_t lastAddress = 0;
+    // The number of data bytes in each line.
+    const size_t lineSize = 16;
 
-    file << std::uppercase;
-    file << std::hex << std::setfill('0') << std::right;
+    size_t capacity = HexWriter::lineLength(0);
+    for (const auto & interval : image.getIntervals())
+    {
+        size_t size = interval.second.size();
+        size_t lines = size / lineSize + 2;
+        capacity += size * 2 + lines * HexWriter::lineLength(0) +
+            (size / 0x10000 + 1) * HexWriter::lineLength(2);
+    }
+    HexWriter writer(capacity);
 
-    for(const Entry & entry : entries)
+    uint32_t lastAddress = 0;
+
+    for (const auto & interval : image.getIntervals())
     {
-        uint32_t address = entry.address;
+        const std::vector<uint8_t> & data = interval.second;
 
-        if ((address >> 16) != (lastAddress >> 16))
+        size_t offset = 0;
+        while (offset < data.size())
         {
-            // Emit an extended linear address record because the high 16 bits changed.
-            writeHexLine(file, 4, 0, {(uint8_t)(address >> 24), (uint8_t)(address >> 16)});
-        }
+            uint32_t address = interval.first + offset;
+
+            // Don't let a line cross a 64 KB boundary.
+            size_t size = std::min<size_t>(lineSize, data.size() - offset);
+            size = std::min<size_t>(size, 0x10000 - (address & 0xFFFF));
+
+            if ((address >> 16) != (lastAddress >> 16))
+            {
+                // Emit an extended linear address record because the high 16 bits changed.
+                uint8_t high[2] = { (uint8_t)(address >> 24), (uint8_t)(address >> 16) };
+                writer.writeLine(4, 0, high, 2);
+            }
 
-        writeHexLine(file, 0, address & 0xFFFF, entry.data);
+            writer.writeLine(0, address & 0xFFFF, &data[offset], size);
 
-        lastAddress = address;
+            lastAddress = address;
+            offset += size;
+        }
     }
-    writeHexLine(file, 1, 0, {});  // End of file.
+    writer.writeLine(1, 0, NULL, 0);  // End of file.
+
+    file.write(writer.buffer.data(), writer.buffer.size());
 }
@@ -4,41 +4,40 @@
 #include <vector>
 #include <iostream>
 #include <cstdint>
+#include "sparse_image.h"
 
 namespace IntelHex
 {
-    class Entry
-    {
-    public:
-        Entry(uint32_t address, std::vector<uint8_t> data)
-            : address(address), data(data)
-        {
-        }
-
-        uint32_t address;
-        std::vector<uint8_t> data;
-    };
-
     class Data
     {
     public:
         void readFromFile(std::istream & file, const char * fileName,
             uint32_t * lineNumber = NULL);
 
+        /* Parses a HEX file that has already been loaded into memory. */
+        void readFromBuffer(const char * buffer, size_t size,
+            const char * fileName, uint32_t * lineNumber = NULL);
+
         void writeToFile(std::ostream & file) const;
 
         std::vector<uint8_t> getImage(uint32_t startAddress, uint32_t size) const;
 
-        void setImage(uint32_t startAddress, std::vector<uint8_t> image,
-            uint32_t blockSize = 16);
+        void setImage(uint32_t startAddress, std::vector<uint8_t> image);
+
+        /* The data from the file.  Data records that overlap each other must
+         * agree about the contents of the overlapping bytes. */
+        const SparseImage & getSparseImage() const
+        {
+            return image;
+        }
 
         operator bool() const
         {
-            return !entries.empty();
+            return !image.empty();
         }
 
     private:
-        std::vector<Entry> entries;
+        SparseImage image;
     };
 
 }
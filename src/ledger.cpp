@@ -0,0 +1,306 @@
+#include "p-load.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+
+static const uint8_t ledgerFlash = 1;
+static const uint8_t ledgerEeprom = 2;
+
+namespace
+{
+    class LedgerEntry
+    {
+    public:
+        std::string serialNumber;
+        uint32_t typeId;
+        uint8_t memories;
+        std::string hash;
+        uint32_t uploadType;
+        std::string time;
+    };
+
+    /* Holds an exclusive lock on the lock file of a ledger.  The lock is on a
+     * separate file because the ledger itself gets replaced. */
+    class LedgerLock
+    {
+    public:
+        explicit LedgerLock(const std::string & fileName)
+        {
+            std::string lockFileName = fileName + ".lock";
+#ifdef _WIN32
+            handle = CreateFileA(lockFileName.c_str(),
+                GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (handle == INVALID_HANDLE_VALUE)
+            {
+                throw std::runtime_error(lockFileName +
+                    ": Failed to open lock file.");
+            }
+            OVERLAPPED overlapped = OVERLAPPED();
+            if (!LockFileEx(handle, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &overlapped))
+            {
+                CloseHandle(handle);
+                throw std::runtime_error(lockFileName + ": Failed to lock file.");
+            }
+#else
+            fd = open(lockFileName.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+            if (fd < 0)
+            {
+                throw std::runtime_error(lockFileName + ": " + strerror(errno) + ".");
+            }
+            // flock locks belong to the open file, so this also keeps out
+            // other threads of this process, like the workers of --all.
+            while (flock(fd, LOCK_EX) != 0)
+            {
+                if (errno == EINTR) { continue; }
+                int error = errno;
+                close(fd);
+                throw std::runtime_error(lockFileName + ": " + strerror(error) + ".");
+            }
+#endif
+        }
+
+        ~LedgerLock()
+        {
+#ifdef _WIN32
+            CloseHandle(handle);
+#else
+            close(fd);
+#endif
+        }
+
+    private:
+        LedgerLock(const LedgerLock &);
+        LedgerLock & operator=(const LedgerLock &);
+
+#ifdef _WIN32
+        HANDLE handle;
+#else
+        int fd;
+#endif
+    };
+}
+
+static uint8_t memoriesForSet(const PloaderType & type, MemorySet memorySet)
+{
+    uint8_t memories = 0;
+    if (type.memorySetIncludesFlash(memorySet)) { memories |= ledgerFlash; }
+    if (type.memorySetIncludesEeprom(memorySet)) { memories |= ledgerEeprom; }
+    return memories;
+}
+
+// Writing or erasing flash can change the EEPROM too (for example, applyImage
+// erases its first byte), so it makes the records of both memories obsolete.
+static uint8_t memoriesTouched(uint8_t memories)
+{
+    if (memories & ledgerFlash) { memories |= ledgerEeprom; }
+    return memories;
+}
+
+static const char * memoriesName(uint8_t memories)
+{
+    switch (memories)
+    {
+    case ledgerFlash: return "flash";
+    case ledgerEeprom: return "eeprom";
+    default: return "all";
+    }
+}
+
+static bool parseMemories(const std::string & name, uint8_t & memories)
+{
+    if (name == "flash") { memories = ledgerFlash; }
+    else if (name == "eeprom") { memories = ledgerEeprom; }
+    else if (name == "all") { memories = ledgerFlash | ledgerEeprom; }
+    else { return false; }
+    return true;
+}
+
+static std::string currentTime()
+{
+    time_t now = time(NULL);
+    struct tm utc;
+#ifdef _WIN32
+    gmtime_s(&utc, &now);
+#else
+    gmtime_r(&now, &utc);
+#endif
+    char buffer[32];
+    strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%SZ", &utc);
+    return buffer;
+}
+
+static std::vector<LedgerEntry> readLedger(const std::string & fileName)
+{
+    std::vector<LedgerEntry> entries;
+
+    std::ifstream file(fileName);
+    if (!file)
+    {
+        if (errno == ENOENT) { return entries; }
+        throw std::runtime_error(fileName + ": " + strerror(errno) + ".");
+    }
+
+    std::string line;
+    uint32_t lineNumber = 0;
+    while (std::getline(file, line))
+    {
+        lineNumber++;
+        if (line.empty() || line[0] == '#') { continue; }
+
+        std::istringstream stream(line);
+        LedgerEntry entry;
+        std::string memories;
+        stream >> entry.serialNumber >> entry.typeId >> memories
+               >> entry.hash >> entry.uploadType >> entry.time;
+        if (!stream || !parseMemories(memories, entry.memories))
+        {
+            throw std::runtime_error(fileName + ":" +
+                std::to_string(lineNumber) + ": Invalid ledger entry.");
+        }
+        entries.push_back(entry);
+    }
+    return entries;
+}
+
+static void writeLedger(const std::string & fileName,
+    const std::vector<LedgerEntry> & entries)
+{
+    std::string tmpFileName = fileName + ".tmp";
+
+    FILE * file = fopen(tmpFileName.c_str(), "w");
+    if (file == NULL)
+    {
+        throw std::runtime_error(tmpFileName + ": " + strerror(errno) + ".");
+    }
+
+    fprintf(file, "# p-load firmware ledger\n");
+    for (const LedgerEntry & entry : entries)
+    {
+        fprintf(file, "%s %u %s %s %u %s\n", entry.serialNumber.c_str(),
+            entry.typeId, memoriesName(entry.memories), entry.hash.c_str(),
+            entry.uploadType, entry.time.c_str());
+    }
+
+    // Make sure the new ledger is on the disk before it replaces the old one.
+    bool success = fflush(file) == 0;
+#ifdef _WIN32
+    success = success && _commit(_fileno(file)) == 0;
+#else
+    success = success && fsync(fileno(file)) == 0;
+#endif
+    int error = errno;
+    success = fclose(file) == 0 && success;
+    if (!success)
+    {
+        remove(tmpFileName.c_str());
+        throw std::runtime_error(tmpFileName + ": " + strerror(error) + ".");
+    }
+
+#ifdef _WIN32
+    if (!MoveFileExA(tmpFileName.c_str(), fileName.c_str(),
+        MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+    {
+        throw std::runtime_error(fileName + ": Failed to replace ledger.");
+    }
+#else
+    if (rename(tmpFileName.c_str(), fileName.c_str()) != 0)
+    {
+        throw std::runtime_error(fileName + ": " + strerror(errno) + ".");
+    }
+
+    // The rename is only on the disk once the directory is.
+    size_t slash = fileName.rfind('/');
+    std::string dirName = slash == std::string::npos ? "." :
+        slash == 0 ? "/" : fileName.substr(0, slash);
+    int dirFd = open(dirName.c_str(), O_RDONLY | O_CLOEXEC);
+    if (dirFd < 0 || fsync(dirFd) != 0)
+    {
+        int error = errno;
+        if (dirFd >= 0) { close(dirFd); }
+        throw std::runtime_error(dirName + ": " + strerror(error) + ".");
+    }
+    close(dirFd);
+#endif
+}
+
+// Removes the entries of the device that involve any of the memories.
+static void removeEntries(std::vector<LedgerEntry> & entries,
+    const PloaderHandle & handle, uint8_t memories)
+{
+    std::vector<LedgerEntry> kept;
+    for (const LedgerEntry & entry : entries)
+    {
+        if (entry.serialNumber == handle.serialNumber &&
+            entry.typeId == handle.type.id && (entry.memories & memories))
+        {
+            continue;
+        }
+        kept.push_back(entry);
+    }
+    entries.swap(kept);
+}
+
+bool FirmwareLedger::contains(const PloaderHandle & handle,
+    const FirmwareData & data, MemorySet memorySet) const
+{
+    // Without a serial number, we cannot tell devices apart.
+    if (handle.serialNumber.empty()) { return false; }
+
+    // The ledger is replaced with a rename, so we can read it without the
+    // lock.
+    uint8_t memories = memoriesForSet(handle.type, memorySet);
+    std::string hash = data.contentHash(handle.type, memorySet);
+    for (const LedgerEntry & entry : readLedger(fileName))
+    {
+        if (entry.serialNumber == handle.serialNumber &&
+            entry.typeId == handle.type.id &&
+            entry.memories == memories && entry.hash == hash)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void FirmwareLedger::record(const PloaderHandle & handle,
+    const FirmwareData & data, MemorySet memorySet) const
+{
+    if (handle.serialNumber.empty()) { return; }
+
+    LedgerEntry entry;
+    entry.serialNumber = handle.serialNumber;
+    entry.typeId = handle.type.id;
+    entry.memories = memoriesForSet(handle.type, memorySet);
+    entry.hash = data.contentHash(handle.type, memorySet);
+    entry.uploadType = data.uploadType(handle.type);
+    entry.time = currentTime();
+
+    LedgerLock lock(fileName);
+    std::vector<LedgerEntry> entries = readLedger(fileName);
+    removeEntries(entries, handle, memoriesTouched(entry.memories));
+    entries.push_back(entry);
+    writeLedger(fileName, entries);
+}
+
+void FirmwareLedger::forget(const PloaderHandle & handle,
+    MemorySet memorySet) const
+{
+    if (handle.serialNumber.empty()) { return; }
+
+    uint8_t memories = memoriesForSet(handle.type, memorySet);
+
+    LedgerLock lock(fileName);
+    std::vector<LedgerEntry> entries = readLedger(fileName);
+    size_t count = entries.size();
+    removeEntries(entries, handle, memoriesTouched(memories));
+    if (entries.size() != count)
+    {
+        writeLedger(fileName, entries);
+    }
+}
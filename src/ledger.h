@@ -0,0 +1,50 @@
+#pragma once
+
+/* The firmware ledger is a text file where p-load records what it wrote to
+ * each device, so that --skip-if-recorded can skip writing the same firmware
+ * again without reading it back, which some bootloaders cannot do.
+ *
+ * Each line describes the last write to some memories of one device:
+ *
+ *   SERIAL TYPE_ID MEMORIES HASH UPLOAD_TYPE TIME
+ *
+ * MEMORIES is "all", "flash", or "eeprom", HASH comes from
+ * FirmwareData::contentHash, and TIME is when the write finished, in UTC.
+ *
+ * Several p-load processes can use the same ledger: every update holds a lock
+ * on FILE.lock while it reads the ledger and replaces it.  The new ledger is
+ * written to FILE.tmp and renamed over the old one, so a crash leaves either
+ * the old ledger or the new one.
+ *
+ * p-load removes the records of the memories it is about to change before it
+ * sends the first request that changes them, and only records the new data
+ * once the write has succeeded, so a write that fails or is interrupted
+ * leaves the device with no record.
+ *
+ * The ledger only knows about writes that were done with it, so it can be
+ * wrong about a device that was written some other way. */
+
+#include "p-load.h"
+
+class FirmwareLedger
+{
+public:
+    explicit FirmwareLedger(const std::string & fileName) : fileName(fileName)
+    {
+    }
+
+    /* Returns true if the ledger says that the last thing written to the
+     * specified memories of the device was this data. */
+    bool contains(const PloaderHandle &, const FirmwareData &, MemorySet) const;
+
+    /* Records that the data was written to the specified memories of the
+     * device, replacing any records of other data in those memories. */
+    void record(const PloaderHandle &, const FirmwareData &, MemorySet) const;
+
+    /* Removes the records of the specified memories of the device, for
+     * example because they were erased. */
+    void forget(const PloaderHandle &, MemorySet) const;
+
+private:
+    std::string fileName;
+};
@@ -0,0 +1,139 @@
+/* The C API of libp-load, which is a thin wrapper around PloadSession. */
+
+#include "libp-load.h"
+#include "session.h"
+
+struct pload_session
+{
+    PloadSession session;
+    std::string error;
+};
+
+// Runs an operation on a session, saving the message of any exception it
+// throws so the caller can get it with pload_session_error.  No exceptions
+// can pass through the C API.
+template <typename Function>
+static int guard(pload_session * session, Function function)
+{
+    if (session == NULL) { return PLOAD_ERROR_BAD_ARGS; }
+    session->error.clear();
+    try
+    {
+        function(session->session);
+        return 0;
+    }
+    catch (const ExceptionWithExitCode & error)
+    {
+        session->error = error.message();
+        return error.getCode();
+    }
+    catch (const std::exception & error)
+    {
+        session->error = error.what();
+        return PLOAD_ERROR_OPERATION_FAILED;
+    }
+}
+
+static MemorySet memorySetFromC(int memory)
+{
+    switch (memory)
+    {
+    case PLOAD_MEMORY_ALL: return MEMORY_SET_ALL;
+    case PLOAD_MEMORY_FLASH: return MEMORY_SET_FLASH;
+    case PLOAD_MEMORY_EEPROM: return MEMORY_SET_EEPROM;
+    default:
+        throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+            "Invalid memory: " + std::to_string(memory) + ".");
+    }
+}
+
+const char * pload_version(void)
+{
+    return VERSION;
+}
+
+pload_session * pload_session_create(void)
+{
+    try
+    {
+        return new pload_session();
+    }
+    catch (const std::exception &)
+    {
+        return NULL;
+    }
+}
+
+void pload_session_destroy(pload_session * session)
+{
+    delete session;
+}
+
+const char * pload_session_error(const pload_session * session)
+{
+    if (session == NULL) { return "No session."; }
+    return session->error.c_str();
+}
+
+void pload_session_set_progress_callback(pload_session * session,
+    pload_progress_callback * callback, void * context)
+{
+    if (session == NULL) { return; }
+    if (callback == NULL)
+    {
+        session->session.setProgressCallback(nullptr);
+        return;
+    }
+    session->session.setProgressCallback(
+        [=](const char * status, uint32_t progress, uint32_t maxProgress)
+        {
+            callback(context, status, progress, maxProgress);
+        });
+}
+
+int pload_session_open(pload_session * session, const char * serial_number,
+    uint32_t timeout_ms)
+{
+    return guard(session, [&](PloadSession & s)
+    {
+        s.open(serial_number ? serial_number : "", timeout_ms);
+    });
+}
+
+int pload_session_load_firmware(pload_session * session, const void * data,
+    size_t size)
+{
+    return guard(session, [&](PloadSession & s)
+    {
+        if (data == NULL && size != 0)
+        {
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                "The firmware data is NULL.");
+        }
+        s.loadFirmware((const char *)data, size);
+    });
+}
+
+int pload_session_write(pload_session * session, int memory)
+{
+    return guard(session, [&](PloadSession & s)
+    {
+        s.write(memorySetFromC(memory));
+    });
+}
+
+int pload_session_verify(pload_session * session, int memory)
+{
+    return guard(session, [&](PloadSession & s)
+    {
+        s.verify(memorySetFromC(memory));
+    });
+}
+
+int pload_session_restart(pload_session * session)
+{
+    return guard(session, [&](PloadSession & s)
+    {
+        s.restart();
+    });
+}
@@ -0,0 +1,84 @@
+/* libp-load: a C interface for loading firmware onto Pololu USB bootloaders
+ * from other programs.
+ *
+ * A program creates a session for each device it wants to program, opens the
+ * device, loads a firmware file (HEX or FMI) from memory, and then writes,
+ * verifies, and restarts the device.  Sessions are independent, so several of
+ * them can be used at once from different threads, but each session should
+ * only be used by one thread at a time.
+ *
+ * Every function that can fail returns 0 on success or one of the
+ * PLOAD_ERROR_* codes on failure, which are the same as the exit codes of the
+ * p-load program.  pload_session_error returns a message describing the last
+ * failure. */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PLOAD_ERROR_BAD_ARGS 1
+#define PLOAD_ERROR_OPERATION_FAILED 2
+#define PLOAD_ERROR_DEVICE_NOT_FOUND 3
+#define PLOAD_ERROR_DEVICE_MULTIPLE_FOUND 4
+#define PLOAD_ERROR_VERIFICATION_FAILED 5
+
+// Values for the memory argument of the functions below.
+#define PLOAD_MEMORY_ALL 0
+#define PLOAD_MEMORY_FLASH 1
+#define PLOAD_MEMORY_EEPROM 2
+
+typedef struct pload_session pload_session;
+
+/* Called with a status message and the progress of the current operation.
+ * If max_progress is 0, the operation has no progress to report. */
+typedef void pload_progress_callback(void * context, const char * status,
+  uint32_t progress, uint32_t max_progress);
+
+/* Returns the version of the library, like "2.4.0". */
+const char * pload_version(void);
+
+/* Creates a session.  Returns NULL if there is not enough memory. */
+pload_session * pload_session_create(void);
+
+/* Closes the device, if it is open, and frees the session. */
+void pload_session_destroy(pload_session *);
+
+/* Returns a message describing the last error that happened in the session.
+ * The string is valid until the next call that uses the session. */
+const char * pload_session_error(const pload_session *);
+
+/* Sets a function that gets called on the thread using the session to report
+ * progress.  Pass NULL to stop reporting progress. */
+void pload_session_set_progress_callback(pload_session *,
+  pload_progress_callback * callback, void * context);
+
+/* Opens the bootloader of the device with the specified serial number, or of
+ * the only device that is connected if serial_number is NULL or empty.  If
+ * the device is running its app, this starts the bootloader and waits up to
+ * timeout_ms milliseconds for it to appear. */
+int pload_session_open(pload_session *, const char * serial_number,
+  uint32_t timeout_ms);
+
+/* Loads the contents of a HEX or FMI file, replacing any firmware loaded
+ * before.  The data is copied, so the buffer can be freed afterwards. */
+int pload_session_load_firmware(pload_session *, const void * data,
+  size_t size);
+
+/* Writes the loaded firmware to the specified memories of the device. */
+int pload_session_write(pload_session *, int memory);
+
+/* Reads back the specified memories of the device and compares them to the
+ * loaded firmware.  Returns PLOAD_ERROR_VERIFICATION_FAILED if they differ. */
+int pload_session_verify(pload_session *, int memory);
+
+/* Restarts the device so it runs its app, and closes the session's device. */
+int pload_session_restart(pload_session *);
+
+#ifdef __cplusplus
+}
+#endif
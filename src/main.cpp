@@ -0,0 +1,15 @@
+/* The entry point of p-load.  The program itself is in p-load.cpp so that it
+ * can also be run in-process, e.g. by the benchmarks. */
+
+#include "p-load.h"
+
+int main(int argc, char ** argv)
+{
+#if defined(_MSC_VER) && defined(_DEBUG)
+    // For a Debug build in Windows, send a report of memory leaks to
+    // the Debug pane of the Output window in Visual Studio.
+    _CrtSetDbgFlag(_CRTDBG_ALLOC_MEM_DF | _CRTDBG_LEAK_CHECK_DF);
+#endif
+
+    return ploadMain(argc, argv);
+}
@@ -1,6 +1,9 @@
 /* Main source file for p-load, the Pololu USB Bootloader Utility. */
 
 #include "p-load.h"
+#include "hex_digits.h"
+#include "session.h"
+#include "station.h"
 
 static const char help[] =
     "p-load: Pololu USB Bootloader Utility\n"
@@ -14,28 +17,54 @@ static const char help[] =
     "  --list-supported            Lists all supported device types.\n"
     "  --start-bootloader          Gets the device into bootloader mode.\n"
     "  --wait                      Waits up to 10 seconds for bootloader to appear.\n"
+    "  --wait-timeout SECONDS      Changes how long to wait for bootloaders.\n"
+    "  --all                       Operates on all qualifying devices at once.\n"
     "  -w FILE                     Writes to device, then restarts it.\n"
     "  --write FILE                Writes to device.\n"
     "  --write-flash HEXFILE       Writes to flash only.\n"
     "  --write-eeprom HEXFILE      Writes to EEPROM only.\n"
+    "  --write-if-different        Skips writes if the device already has the data.\n"
+    "  --verify                    Reads back and checks the data after writing.\n"
+    "  --ledger LEDGERFILE         Records what gets written to each device.\n"
+    "  --skip-if-recorded          Skips writes that the ledger shows were done.\n"
     "  --erase                     Erases device.\n"
     "  --erase-flash               Erases flash only.\n"
     "  --erase-eeprom              Erases EEPROM only.\n"
     "  --read HEXFILE              Reads from device and saves to file.\n"
-    "  --read-flash HEXFILE        Reads flash only and saves to file.\n"
-    "  --read-eeprom HEXFILE       Reads EEPROM only and saves to file.\n"
+    "  --read-flash HEXFILE[@START:LEN]\n"
+    "                              Reads flash only and saves to file.\n"
+    "  --read-eeprom HEXFILE[@START:LEN]\n"
+    "                              Reads EEPROM only and saves to file.\n"
+    "  --patch-eeprom PATCHES      Changes some bytes of EEPROM, leaving the rest.\n"
+    "  --audit HEXFILE             Compares all devices to HEXFILE, saving the\n"
+    "                              memories of the ones that differ.\n"
     "  --restart                   Restarts the device so it can run the new code.\n"
     "  --pause-on-error            Pause at the end if an error happens.\n"
     "  --pause                     Pause at the end.\n"
+    "  --trace FILE                Saves a Chrome trace of how long each step took.\n"
+    "  --stats                     Prints USB request counts and latencies at exit.\n"
+    "  --simulate SETTINGS         Uses simulated devices instead of USB.\n"
+    "  --daemon SOCKET             Runs a station daemon that takes write jobs.\n"
+    "  --connect SOCKET            Sends the write job to a station daemon.\n"
     "  -h, --help                  Show this help screen.\n"
     "\n"
     "HEXFILE is the name of the .HEX file to be used.\n"
     "FILE is the name of the .HEX or .FMI file to be used.\n"
+    "START:LEN reads LEN bytes from flash address or EEPROM offset START.\n"
+    "PATCHES is a comma-separated list of EEPROM offsets and hex bytes like\n"
+    "  0x10=0102FF,0x40=AA.\n"
+    "LEDGERFILE is a file that p-load creates and several p-loads can share.\n"
+    "SETTINGS is a comma-separated list like type=tic,count=4,mode=app.\n"
+    "SOCKET is the path of a Unix domain socket.\n"
     "\n"
     "Example: p-load -t p-star -w app.hex\n"
     "Example: p-load -w pgm04a-v1.00.fmi\n"
     "Example: p-load -d 12345678 --wait --write-flash app.hex --restart\n"
     "Example: p-load -t p-star --erase\n"
+    "Example: p-load -t p-star --read-flash version.hex@0x7F00:0x100\n"
+    "Example: p-load -t p-star --patch-eeprom 0x10=0102FF\n"
+    "Example: p-load -t tic --all -w tic01a-v1.06.fmi\n"
+    "Example: p-load --connect /tmp/p-load.sock -d 12345678 -w app.hex\n"
     "\n";
 
 // GCC 4.6 doesn't support the override keyword.
@@ -44,29 +73,109 @@ static const char help[] =
 #endif
 
 class Action;
+class ActionPatchEeprom;
+class ActionFileReader;
+class GangDevice;
+
+typedef std::vector<std::unique_ptr<GangDevice>> GangDeviceList;
+
+/* One run of p-load with some command-line arguments.  All of the state of the
+ * run lives in this object, so ploadMain can run more than once in the same
+ * process without anything left over from earlier runs.  The USB bus used for
+ * listing devices, tracing, and transfer stats are still process-wide
+ * settings. */
+class PloadCommand
+{
+public:
+    PloadCommand();
+    ~PloadCommand();
 
-static DeviceSelector selector;
-
-static Output output;
+    // Runs p-load and returns the exit code.
+    int main(int argc, char ** argv);
 
-// These variables store the results from parsing the command-line arguments.
-static std::vector<Action *> actions;
-static bool showHelpFlag = false;
-static bool listDevicesFlag = false;
-static bool listSupportedFlag = false;
-static bool startBootloaderFlag = false;
-static bool waitForBootloaderFlag = false;
-static bool restartBootloaderFlag = false;
-static bool pauseFlag = false;
-static bool pauseOnErrorFlag = false;
+private:
+    PloadCommand(const PloadCommand &);
+    PloadCommand & operator=(const PloadCommand &);
+
+    bool bootloaderHandleNeeded();
+    bool someCommandSpecified();
+    void listDevices();
+    bool launchBootloaderIfNeeded();
+    void sessionOpen(PloadSession &, const PloaderInstance &,
+        PloaderStatusListener &);
+    void bootloaderSessionOpen(PloadSession &);
+    void waitForBootloader();
+    void restartBootloader(PloadSession &);
+    void addAction(Action *, ArgReader &);
+    void parseArgs(int argc, char ** argv);
+    void gangWorker(GangDevice *);
+    void gangPrintInfo(const char * message);
+    std::set<std::string> gangLaunchBootloaders(GangDeviceList &);
+    void printGangResults(const GangDeviceList &);
+    void runGang(ActionFileReader &);
+    void planActions();
+    void run(int argc, char ** argv);
+    void writeTrace();
+
+    DeviceSelector selector;
+
+    Output output;
+
+    // These variables store the results from parsing the command-line
+    // arguments.
+    std::vector<Action *> actions;
+    bool showHelpFlag;
+    bool listDevicesFlag;
+    bool listSupportedFlag;
+    bool startBootloaderFlag;
+    bool waitForBootloaderFlag;
+    bool allDevicesFlag;
+    uint32_t waitTimeoutMs;
+    PloadWriteOptions writeOptions;
+    bool auditFlag;
+    bool restartBootloaderFlag;
+    bool pauseFlag;
+    bool pauseOnErrorFlag;
+    std::string traceFileName;
+    bool daemonFlag;
+    std::string stationSocketPath;
+
+    // The device and write options given on the command line, for --connect.
+    StationJob stationJob;
+
+    // The action of the last --patch-eeprom option, which the next one is
+    // merged into if nothing came between them.
+    ActionPatchEeprom * patchAction;
+
+    // True if we have printed the name and serial number of the device we are
+    // operating on.
+    bool deviceInfoPrinted;
+
+    // Serializes all console output from the gang workers.
+    std::mutex gangOutputMutex;
+};
 
-// True if we have printed the name and serial number of the device we are
-// operating on.
-static bool deviceInfoPrinted = false;
+PloadCommand::PloadCommand()
+    : showHelpFlag(false),
+      listDevicesFlag(false),
+      listSupportedFlag(false),
+      startBootloaderFlag(false),
+      waitForBootloaderFlag(false),
+      allDevicesFlag(false),
+      waitTimeoutMs(10000),
+      auditFlag(false),
+      restartBootloaderFlag(false),
+      pauseFlag(false),
+      pauseOnErrorFlag(false),
+      daemonFlag(false),
+      patchAction(NULL),
+      deviceInfoPrinted(false)
+{
+}
 
 // Returns true if we actually want to get to the state where a bootloader is
 // connected to the computer and we have selected it.
-static bool bootloaderHandleNeeded()
+bool PloadCommand::bootloaderHandleNeeded()
 {
     return startBootloaderFlag ||
         restartBootloaderFlag ||
@@ -74,9 +183,10 @@ static bool bootloaderHandleNeeded()
 }
 
 // Returns true if some sort of action was specified on the command line.
-static bool someCommandSpecified()
+bool PloadCommand::someCommandSpecified()
 {
     return showHelpFlag ||
+        !stationSocketPath.empty() ||
         listDevicesFlag ||
         listSupportedFlag ||
         startBootloaderFlag ||
@@ -123,7 +233,7 @@ static const char * getStatus(const PloaderInstance & instance)
         PloaderHandle handle(instance);
         return handle.checkApplication() ? "App present" : "No app present";
     }
-    catch(const libusbp::error & error)
+    catch(const PloaderTransferError & error)
     {
         return "?";
     }
@@ -145,7 +255,7 @@ static void printSelectedDeviceInfo(std::string name, std::string serialNumber)
 }
 
 // Prints a list of bootloaders and apps connected to the computer.
-static void listDevices()
+void PloadCommand::listDevices()
 {
     auto bootloaderList = selector.listBootloaders();
     auto appList = selector.listApps();
@@ -173,7 +283,7 @@ static void listDevices()
     }
 }
 
-static bool launchBootloaderIfNeeded()
+bool PloadCommand::launchBootloaderIfNeeded()
 {
     if (!bootloaderHandleNeeded())
     {
@@ -199,7 +309,21 @@ static bool launchBootloaderIfNeeded()
     return true;
 }
 
-static PloaderHandle bootloaderHandleOpen()
+// Opens the selected bootloader in a session that reports its progress to
+// the specified listener and writes with the options from the command line.
+void PloadCommand::sessionOpen(PloadSession & session,
+    const PloaderInstance & instance, PloaderStatusListener & listener)
+{
+    session.setWriteOptions(writeOptions);
+    session.setProgressCallback([&listener](const char * status,
+        uint32_t progress, uint32_t maxProgress)
+    {
+        listener.setStatus(status, progress, maxProgress);
+    });
+    session.open(PloaderHandle(instance));
+}
+
+void PloadCommand::bootloaderSessionOpen(PloadSession & session)
 {
     PloaderInstance instance = selector.selectBootloader();
 
@@ -209,12 +333,10 @@ static PloaderHandle bootloaderHandleOpen()
         printSelectedDeviceInfo(instance.type.name, instance.serialNumber);
     }
 
-    PloaderHandle handle(instance);
-    handle.setStatusListener(&output);
-    return handle;
+    sessionOpen(session, instance, output);
 }
 
-static void waitForBootloader()
+void PloadCommand::waitForBootloader()
 {
     auto bootloaderList = selector.listBootloaders();
     if (bootloaderList.size () > 0)
@@ -224,46 +346,30 @@ static void waitForBootloader()
 
     output.printInfo("Waiting for bootloader...");
 
-    time_t waitStartTime = time(NULL);
-
-    while(1)
+    TraceSpan span("wait-for-bootloader");
+    DeviceWaitLoop waitLoop(selector, waitTimeoutMs);
+    bool found = waitLoop.waitUntil([this]()
     {
-        auto bootloaderList = selector.listBootloaders();
-
-        if (bootloaderList.size() > 0)
-        {
-            return;
-        }
+        return selector.listBootloaders().size() > 0;
+    });
 
-        if (difftime(time(NULL), waitStartTime) > 10)
-        {
-            throw selector.deviceNotFoundError();
-        }
-
-	// Sleep so that we don't take up 100% CPU time.
-#ifdef _MSC_VER
-        Sleep(100);     // 100 ms
-#else
-        usleep(100000); // 100 ms
-#endif
-
-        // The previous lists of devices we had are now stale because we
-        // delayed.  Clear them.  (This is our way of telling the device
-        // selector that the program is delaying; the function could have been
-        // named something like "handleDelay" just as well.)
-        selector.clearDeviceLists();
+    if (!found)
+    {
+        throw selector.deviceNotFoundError();
     }
 }
 
-static void restartBootloader(PloaderHandle & handle)
+void PloadCommand::restartBootloader(PloadSession & session)
 {
-    handle.restartDevice();
+    session.restart();
     output.printInfo("Sent command to restart device.");
 }
 
 /* Every Action represents a read or write from memory on the bootloader.
  * If any actions are specified by the user, we will attempt to get
- * the device into bootloader mode and open a handle to the bootloader. */
+ * the device into bootloader mode and open a session with the bootloader.
+ * The actions that change the device leave the details to PloadSession, so
+ * they behave the same way as programs that use libp-load. */
 class Action
 {
 public:
@@ -272,16 +378,53 @@ public:
     // Does not open any handles to external devices.
     virtual void parseArguments(ArgReader &) { }
 
+    // Opens the files the action needs, so that missing files are reported
+    // before anything is done to the devices.  This runs before readFiles, on
+    // the main thread.
+    virtual void openFiles() { }
+
+    // Parses the files that openFiles opened.  This might run on a background
+    // thread (see ActionFileReader), so it must not touch any global state.
     virtual void readFiles() { }
 
+    // Tells the device selector about the files that were read, so it can
+    // infer which types of devices to look for.
+    virtual void specifyFirmwareData(DeviceSelector &) { }
+
     // Raises an exception if this action is not compatible with the selected
     // bootloader.
-    virtual void ensureBootloaderCompatibility(const PloaderHandle &) = 0;
+    virtual void ensureBootloaderCompatibility(const PloadSession &) = 0;
 
-    virtual void writeFiles() { }
+    virtual void writeFiles(Output &) { }
+
+    // Tells the action that the actions could not be finished on a device
+    // when running on several devices at once.  This gets called for each
+    // device that failed before any of the calls to writeFiles.
+    virtual void deviceFailed(const std::string &, uint8_t,
+        const std::string &) { }
 
     // Actually executes the action.
-    virtual void execute(PloaderHandle &) = 0;
+    virtual void execute(PloadSession &) = 0;
+
+    // Returns false if this action cannot be executed on several devices at
+    // once (for example, because it would write to the same file).
+    virtual bool supportsMultipleDevices() const { return true; }
+
+    // Returns true if planActions may fuse this action with the write and
+    // erase actions next to it.
+    virtual bool canBeFused() const { return false; }
+
+    // Fills in the file and memories of a job for a station daemon.  Returns
+    // false if the action cannot be sent to a daemon.
+    virtual bool addToStationJob(StationJob &) const { return false; }
+
+    // Adds the effect of this action to a plan for the specified bootloader.
+    // Returns false if the action cannot be expressed that way, in which case
+    // the fused actions just run one at a time.
+    virtual bool addToPlan(WritePlan &, const PloaderType &) const
+    {
+        return false;
+    }
 
     virtual ~Action() { }
 };
@@ -302,26 +445,70 @@ public:
         fileName = arg;
     }
 
-    void readFiles() override
+    void openFiles() override
     {
         assert(fileName != NULL);
+        contents.reset(new FileContents(fileName));
+    }
+
+    void readFiles() override
+    {
+        assert(contents);
         assert(!data);
-        data.readFromFile(fileName);
+        data.readFromBuffer(contents->data(), contents->size(), fileName);
+        contents.reset();
+    }
+
+    void specifyFirmwareData(DeviceSelector & selector) override
+    {
         selector.specifyFirmwareData(data);
     }
 
-    void ensureBootloaderCompatibility(const PloaderHandle & handle) override
+    void ensureBootloaderCompatibility(const PloadSession & session) override
+    {
+        session.ensureCanWrite(data, memorySet);
+    }
+
+    void execute(PloadSession & session) override
+    {
+        session.write(data, memorySet);
+    }
+
+    bool canBeFused() const override
+    {
+        return true;
+    }
+
+    bool addToStationJob(StationJob & job) const override
     {
-        data.ensureBootloaderCompatibility(handle.type, memorySet);
+        job.fileName = fileName;
+        job.memorySet = memorySet;
+        return true;
     }
 
-    void execute(PloaderHandle & handle) override
+    bool addToPlan(WritePlan & plan, const PloaderType & type) const override
     {
-        data.writeToBootloader(handle, memorySet);
+        // FMI images come with their own sequence of requests, so only HEX
+        // data can be fused.
+        if (!data.hexData) { return false; }
+
+        if (type.memorySetIncludesFlash(memorySet))
+        {
+            plan.flashTouched = true;
+            plan.flashData = &data;
+        }
+
+        if (type.memorySetIncludesEeprom(memorySet))
+        {
+            plan.eepromTouched = true;
+            plan.eepromData = &data;
+        }
+        return true;
     }
 
 private:
     const char * fileName;
+    std::unique_ptr<FileContents> contents;  // from openFiles until readFiles
     FirmwareData data;
     MemorySet memorySet;
 };
@@ -331,32 +518,77 @@ class ActionEraseMemory : public Action
 public:
     ActionEraseMemory(MemorySet ms) : memorySet(ms) { }
 
-    void ensureBootloaderCompatibility(const PloaderHandle & handle) override
+    void ensureBootloaderCompatibility(const PloadSession & session) override
+    {
+        session.getType().ensureErasing(memorySet);
+    }
+
+    void execute(PloadSession & session) override
     {
-        handle.type.ensureErasing(memorySet);
+        session.erase(memorySet);
     }
 
-    void execute(PloaderHandle & handle) override
+    bool canBeFused() const override
     {
-        if (handle.type.memorySetIncludesFlash(memorySet))
+        return true;
+    }
+
+    bool addToPlan(WritePlan & plan, const PloaderType & type) const override
+    {
+        if (type.memorySetIncludesFlash(memorySet))
         {
-            handle.initialize();
-            handle.eraseFlash();
+            plan.flashTouched = true;
+            plan.flashData = NULL;
         }
 
-        if (handle.type.memorySetIncludesEeprom(memorySet))
+        if (type.memorySetIncludesEeprom(memorySet))
         {
-            handle.eraseEeprom();
+            plan.eepromTouched = true;
+            plan.eepromData = NULL;
         }
+        return true;
     }
 
     MemorySet memorySet;
 };
 
+// Parses a number for a command-line option, in decimal or in hex with "0x".
+static bool parseAddress(const std::string & s, uint32_t & value)
+{
+    if (s.empty() || s[0] == '-') { return false; }
+    char * end;
+    errno = 0;
+    unsigned long long v = strtoull(s.c_str(), &end, 0);
+    if (*end != 0 || errno || v > 0xFFFFFFFF) { return false; }
+    value = v;
+    return true;
+}
+
+// If the argument ends with "@START:LEN", removes that from the file name and
+// returns true.
+static bool parseReadRange(std::string & fileName, uint32_t & start,
+    uint32_t & size)
+{
+    size_t at = fileName.rfind('@');
+    if (at == std::string::npos) { return false; }
+    size_t colon = fileName.find(':', at);
+    if (colon == std::string::npos) { return false; }
+    if (!parseAddress(fileName.substr(at + 1, colon - at - 1), start) ||
+        !parseAddress(fileName.substr(colon + 1), size))
+    {
+        return false;
+    }
+    fileName.resize(at);
+    return true;
+}
+
 class ActionReadMemory : public Action
 {
 public:
-    ActionReadMemory(MemorySet ms) : fileName(NULL), memorySet(ms) { }
+    ActionReadMemory(MemorySet ms)
+        : memorySet(ms), hasRange(false), rangeStart(0), rangeSize(0)
+    {
+    }
 
     void parseArguments(ArgReader & argReader) override
     {
@@ -367,37 +599,94 @@ public:
                 std::string("Expected a filename after ") + argReader.last() + ".");
         }
         fileName = arg;
+
+        hasRange = parseReadRange(fileName, rangeStart, rangeSize);
+        if (hasRange && memorySet == MEMORY_SET_ALL)
+        {
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                "A range can only be read with --read-flash or --read-eeprom.");
+        }
+        if (hasRange && rangeSize == 0)
+        {
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                "The range to read is empty.");
+        }
     }
 
-    void ensureBootloaderCompatibility(const PloaderHandle & handle) override
+    void ensureBootloaderCompatibility(const PloadSession & session) override
     {
-        handle.type.ensureReading(memorySet);
+        const PloaderType & type = session.getType();
+        type.ensureReading(memorySet);
+
+        if (hasRange)
+        {
+            // Flash ranges use flash addresses, while EEPROM ranges start at
+            // 0 for the first byte of EEPROM.
+            bool flash = memorySet == MEMORY_SET_FLASH;
+            uint32_t start = flash ? type.appAddress : 0;
+            uint32_t size = flash ? type.appSize : type.eepromSize;
+            if (rangeStart < start || rangeSize > size ||
+                rangeStart - start > size - rangeSize)
+            {
+                char message[128];
+                snprintf(message, sizeof(message),
+                    "The range to read must be within 0x%X to 0x%X.",
+                    start, start + size);
+                throw std::runtime_error(message);
+            }
+        }
     }
 
-    void execute(PloaderHandle & handle) override
+    void execute(PloadSession & session) override
     {
+        PloaderHandle & handle = session.getHandle();
         const PloaderType & type = handle.type;
 
         // Read from the bootloader's flash if needed.
         if (type.memorySetIncludesFlash(memorySet))
         {
-            MemoryImage flash(type.appSize);
-            handle.readFlash(&flash[0]);
-            hexData.setImage(type.appAddress, flash);
+            if (hasRange)
+            {
+                MemoryImage flash(rangeSize);
+                handle.readFlashRange(rangeStart, rangeSize, &flash[0]);
+                hexData.setImage(rangeStart, std::move(flash));
+            }
+            else
+            {
+                MemoryImage flash(type.appSize);
+                handle.readFlash(&flash[0]);
+                hexData.setImage(type.appAddress, std::move(flash));
+            }
         }
 
         // Read from the bootloader's EEPROM if needed.
         if (type.memorySetIncludesEeprom(memorySet))
         {
-            MemoryImage eeprom(type.eepromSize);
-            handle.readEeprom(&eeprom[0]);
-            hexData.setImage(type.eepromAddressHexFile, eeprom);
+            if (hasRange)
+            {
+                MemoryImage eeprom(rangeSize);
+                handle.readEepromRange(type.eepromAddress + rangeStart,
+                    rangeSize, &eeprom[0]);
+                hexData.setImage(type.eepromAddressHexFile + rangeStart,
+                    std::move(eeprom));
+            }
+            else
+            {
+                MemoryImage eeprom(type.eepromSize);
+                handle.readEeprom(&eeprom[0]);
+                hexData.setImage(type.eepromAddressHexFile, std::move(eeprom));
+            }
         }
     }
 
-    void writeFiles() override
+    bool supportsMultipleDevices() const override
     {
-        assert(fileName != NULL);
+        return false;
+    }
+
+    void writeFiles(Output &) override
+    {
+        assert(!fileName.empty());
         assert(hexData);
 
         auto filePtr = openFileOrPipeOutput(fileName);
@@ -405,159 +694,1150 @@ public:
     }
 
 private:
-    const char * fileName;
+    std::string fileName;
     IntelHex::Data hexData;
     MemorySet memorySet;
+
+    // The part of the memory to read, for arguments like FILE@START:LEN.
+    bool hasRange;
+    uint32_t rangeStart;
+    uint32_t rangeSize;
 };
 
-void addAction(Action * action, ArgReader & argReader)
+/* Changes a few bytes of EEPROM without rewriting the rest, for updating
+ * parameters stored there.  Consecutive --patch-eeprom options are merged into
+ * one of these, so the blocks they share are only read and written once. */
+class ActionPatchEeprom : public Action
 {
-    action->parseArguments(argReader);
-    actions.push_back(action);
-}
+public:
+    void parseArguments(ArgReader & argReader) override
+    {
+        const char * arg = argReader.next();
+        if (arg == NULL || arg[0] == 0)
+        {
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                std::string("Expected patches after ") + argReader.last() + ".");
+        }
 
-void parseArgs(int argc, char ** argv)
-{
-    ArgReader argReader(argc, argv);
+        std::istringstream stream(arg);
+        std::string item;
+        while (std::getline(stream, item, ','))
+        {
+            addPatch(item);
+        }
+    }
 
-    while (1)
+    void ensureBootloaderCompatibility(const PloadSession & session) override
     {
-        const char * argCStr = argReader.next();
+        const PloaderType & type = session.getType();
+        type.ensureEepromAccess();
 
-        if (argCStr == NULL)
+        const SparseImage::IntervalMap & intervals = patch.getIntervals();
+        auto last = intervals.rbegin();
+        if (last->first + last->second.size() > type.eepromSize)
         {
-            break;  // Done reading arguments.
+            char message[128];
+            snprintf(message, sizeof(message),
+                "The EEPROM patches must be within offsets 0x0 to 0x%X.",
+                type.eepromSize);
+            throw std::runtime_error(message);
         }
+    }
 
-        std::string arg = argCStr;
+    void execute(PloadSession & session) override
+    {
+        session.patchEeprom(patch);
+    }
 
-        if (arg == "-t")
+private:
+    // Adds a patch like "0x10=0102FF" to the ones this action writes.
+    void addPatch(const std::string & item)
+    {
+        size_t equals = item.find('=');
+        std::string bytes = item.substr(equals == std::string::npos ? 0 : equals + 1);
+        uint32_t offset;
+        if (equals == std::string::npos ||
+            !parseAddress(item.substr(0, equals), offset) ||
+            bytes.empty() || bytes.size() % 2 != 0)
         {
-            const char * s = argReader.next();
-            if (s == NULL)
-            {
-                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
-                    "Expected a device type after '" + std::string(argReader.last()) + "'.");
-            }
-            const PloaderUserType * userType = ploaderUserTypeLookup(s);
-            if (userType == NULL)
-            {
-                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
-                    "Invalid device type '" + std::string(s) + "'.");
-            }
-            selector.specifyUserType(*userType);
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                "Invalid EEPROM patch: '" + item + "'.");
         }
-        else if (arg == "-d")
+
+        MemoryImage data(bytes.size() / 2);
+        for (size_t i = 0; i < data.size(); i++)
         {
-            if (selector.serialNumberWasSpecified())
-            {
-                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
-                    "A serial number can only be specified once.");
-            }
-            const char * s = argReader.next();
-            if (s == NULL)
-            {
-                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
-                    "Expected a serial number after '" + std::string(argReader.last()) + "'.");
-            }
-            if (s[0] == 0)
+            if (!decodeHexByte(&bytes[i * 2], data[i]))
             {
                 throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
-                    "An empty serial number was specified.");
+                    "Invalid EEPROM patch: '" + item + "'.");
             }
-            selector.specifySerialNumber(s);
-        }
-        else if (arg == "--list")
-        {
-            listDevicesFlag = true;
-        }
-        else if (arg == "--list-supported")
-        {
-            listSupportedFlag = true;
-        }
-        else if (arg == "--start-bootloader")
-        {
-            startBootloaderFlag = true;
         }
-        else if (arg == "--wait")
+
+        if (data.size() > 0xFFFFFFFF - offset)
         {
-            waitForBootloaderFlag = true;
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                "Invalid EEPROM patch: '" + item + "'.");
         }
-        else if (arg == "-w")
+
+        try
         {
-            addAction(new ActionWriteMemory(MEMORY_SET_ALL), argReader);
-            restartBootloaderFlag = true;
+            patch.write(offset, std::move(data));
         }
-        else if (arg == "--write")
+        catch (const std::runtime_error & error)
         {
-            addAction(new ActionWriteMemory(MEMORY_SET_ALL), argReader);
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                std::string("EEPROM patches disagree: ") + error.what());
         }
-        else if (arg == "--write-flash")
+    }
+
+    // The new bytes, keyed by EEPROM offset.
+    SparseImage patch;
+};
+
+/* Reads the memories of a device and compares them to a golden image, for
+ * --audit.  The gang workers run this on many devices at once, so the results
+ * are collected under a mutex, and writeFiles prints them as a table and saves
+ * the memories of the devices that do not match.  Devices that could not be
+ * read are in the table too, so every device is counted. */
+class ActionAudit : public Action
+{
+public:
+    ActionAudit() : fileName(NULL), failureExitCode(0) { }
+
+    void parseArguments(ArgReader & argReader) override
+    {
+        const char * arg = argReader.next();
+        if (arg == NULL)
         {
-            addAction(new ActionWriteMemory(MEMORY_SET_FLASH), argReader);
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                std::string("Expected a filename after ") + argReader.last() + ".");
         }
-        else if (arg == "--write-eeprom")
+        fileName = arg;
+    }
+
+    void openFiles() override
+    {
+        assert(fileName != NULL);
+        contents.reset(new FileContents(fileName));
+    }
+
+    void readFiles() override
+    {
+        assert(contents);
+        golden.readFromBuffer(contents->data(), contents->size(), fileName);
+        contents.reset();
+        if (!golden.hexData)
         {
-            addAction(new ActionWriteMemory(MEMORY_SET_EEPROM), argReader);
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                std::string(fileName) + ": The golden image must be a HEX file.");
         }
-        else if (arg == "--erase")
+    }
+
+    void specifyFirmwareData(DeviceSelector & selector) override
+    {
+        selector.specifyFirmwareData(golden);
+    }
+
+    void ensureBootloaderCompatibility(const PloadSession & session) override
+    {
+        session.getType().ensureReading(MEMORY_SET_ALL);
+    }
+
+    void execute(PloadSession & session) override
+    {
+        PloaderHandle & handle = session.getHandle();
+        const PloaderType & type = handle.type;
+        Result result;
+        result.name = type.name;
+
+        FirmwareData device;
+        MemoryImage flash(type.appSize);
+        handle.readFlash(&flash[0]);
+        compare(golden.hexData.getImage(type.appAddress, type.appSize),
+            flash, "flash", type.appAddress, result.firstDifference);
+        device.hexData.setImage(type.appAddress, std::move(flash));
+
+        if (type.memorySetIncludesEeprom(MEMORY_SET_ALL))
         {
-            addAction(new ActionEraseMemory(MEMORY_SET_ALL), argReader);
+            MemoryImage eeprom(type.eepromSize);
+            handle.readEeprom(&eeprom[0]);
+            compare(golden.hexData.getImage(type.eepromAddressHexFile, type.eepromSize),
+                eeprom, "EEPROM", type.eepromAddress, result.firstDifference);
+            device.hexData.setImage(type.eepromAddressHexFile, std::move(eeprom));
         }
-        else if (arg == "--erase-flash")
+
+        result.fingerprint = device.contentHash(type, MEMORY_SET_ALL);
+
+        // Only keep the memories if we are going to save them.
+        if (!result.firstDifference.empty())
         {
-            addAction(new ActionEraseMemory(MEMORY_SET_FLASH), argReader);
+            result.memories = std::move(device.hexData);
         }
-        else if (arg == "--erase-eeprom")
+
+        std::lock_guard<std::mutex> lock(resultsMutex);
+        results[handle.serialNumber] = std::move(result);
+    }
+
+    void deviceFailed(const std::string & serialNumber,
+        uint8_t exitCode, const std::string & message) override
+    {
+        std::lock_guard<std::mutex> lock(resultsMutex);
+        Result & result = results[serialNumber];
+        result = Result();
+        result.error = message;
+        if (failureExitCode == 0) { failureExitCode = exitCode; }
+    }
+
+    void writeFiles(Output & output) override
+    {
+        size_t failureCount = 0;
+        size_t mismatchCount = 0;
+        for (auto & pair : results)
         {
-            addAction(new ActionEraseMemory(MEMORY_SET_EEPROM), argReader);
+            Result & result = pair.second;
+            if (!result.error.empty())
+            {
+                failureCount++;
+                continue;
+            }
+            if (result.firstDifference.empty()) { continue; }
+            mismatchCount++;
+            result.dumpFileName = "audit-" + pair.first + ".hex";
+            auto filePtr = openFileOrPipeOutput(result.dumpFileName);
+            result.memories.writeToFile(*filePtr);
         }
-        else if (arg == "--read")
+
+        output.startNewLine();
+        char line[160];
+        snprintf(line, sizeof(line), "%-16s %-16s %-8s %-14s %s",
+            "Serial number", "Fingerprint", "Result", "First diff.", "Saved to");
+        std::cout << line << std::endl;
+        for (const auto & pair : results)
         {
-            addAction(new ActionReadMemory(MEMORY_SET_ALL), argReader);
+            const Result & result = pair.second;
+            if (!result.error.empty())
+            {
+                snprintf(line, sizeof(line), "%-16s %-16s %-8s %-14s %s",
+                    pair.first.c_str(), "-", "ERROR", "-", "-");
+                std::cout << line << std::endl;
+                continue;
+            }
+            bool match = result.firstDifference.empty();
+            snprintf(line, sizeof(line), "%-16s %-16s %-8s %-14s %s",
+                pair.first.c_str(), result.fingerprint.c_str(),
+                match ? "match" : "MISMATCH",
+                match ? "-" : result.firstDifference.c_str(),
+                match ? "-" : result.dumpFileName.c_str());
+            std::cout << line << std::endl;
         }
-        else if (arg == "--read-flash")
+
+        if (failureCount == 0 && mismatchCount == 0) { return; }
+
+        // A device that could not be read might not match either, so the
+        // code from the first failure wins over the verification code.
+        std::string total = std::to_string(results.size());
+        std::string message;
+        if (failureCount)
         {
-            addAction(new ActionReadMemory(MEMORY_SET_FLASH), argReader);
+            message = std::to_string(failureCount) + " of " + total +
+                " devices could not be read";
+            message += mismatchCount ? " and " : ".";
         }
-        else if (arg == "--read-eeprom")
+        if (mismatchCount)
         {
-            addAction(new ActionReadMemory(MEMORY_SET_EEPROM), argReader);
+            message += std::to_string(mismatchCount) + " of " + total +
+                " devices do not match " + fileName + ".";
+        }
+        throw ExceptionWithExitCode(failureCount ? failureExitCode :
+            PLOAD_ERROR_VERIFICATION_FAILED, message);
+    }
+
+private:
+    class Result
+    {
+    public:
+        std::string name;
+        std::string fingerprint;
+        std::string firstDifference;  // empty if the memories match
+        std::string error;  // empty if the memories were read
+        IntelHex::Data memories;
+        std::string dumpFileName;
+    };
+
+    // Describes the first byte that differs, unless an earlier memory already
+    // had a difference.
+    static void compare(const MemoryImage & expected, const MemoryImage & actual,
+        const char * memory, uint32_t address, std::string & firstDifference)
+    {
+        if (!firstDifference.empty()) { return; }
+        assert(expected.size() == actual.size());
+        auto mismatch = std::mismatch(expected.begin(), expected.end(),
+            actual.begin());
+        if (mismatch.first == expected.end()) { return; }
+
+        char description[32];
+        snprintf(description, sizeof(description), "%s 0x%04X", memory,
+            (unsigned int)(address + (mismatch.first - expected.begin())));
+        firstDifference = description;
+    }
+
+    const char * fileName;
+    std::unique_ptr<FileContents> contents;  // from openFiles until readFiles
+    FirmwareData golden;
+    std::mutex resultsMutex;
+    std::map<std::string, Result> results;
+    uint8_t failureExitCode;
+};
+
+/* Made by planActions from a run of write and erase actions.  Instead of
+ * letting each action initialize, erase, and write on its own, it works out
+ * what the memories of the device should contain at the end, and
+ * PloadSession::writePlan gets there with at most one initialization, one
+ * flash erase, and one write of each memory. */
+class ActionWriteSession : public Action
+{
+public:
+    explicit ActionWriteSession(std::vector<Action *> actions)
+        : actions(actions)
+    {
+    }
+
+    ~ActionWriteSession()
+    {
+        for (Action * action : actions)
+        {
+            delete action;
+        }
+    }
+
+    void openFiles() override
+    {
+        for (Action * action : actions)
+        {
+            action->openFiles();
+        }
+    }
+
+    void readFiles() override
+    {
+        for (Action * action : actions)
+        {
+            action->readFiles();
+        }
+    }
+
+    void specifyFirmwareData(DeviceSelector & selector) override
+    {
+        for (Action * action : actions)
+        {
+            action->specifyFirmwareData(selector);
+        }
+    }
+
+    void ensureBootloaderCompatibility(const PloadSession & session) override
+    {
+        for (Action * action : actions)
+        {
+            action->ensureBootloaderCompatibility(session);
+        }
+    }
+
+    void writeFiles(Output & output) override
+    {
+        for (Action * action : actions)
+        {
+            action->writeFiles(output);
+        }
+    }
+
+    bool supportsMultipleDevices() const override
+    {
+        for (Action * action : actions)
+        {
+            if (!action->supportsMultipleDevices()) { return false; }
+        }
+        return true;
+    }
+
+    void execute(PloadSession & session) override
+    {
+        WritePlan plan;
+        for (Action * action : actions)
+        {
+            if (!action->addToPlan(plan, session.getType()))
+            {
+                for (Action * action : actions)
+                {
+                    action->execute(session);
+                }
+                return;
+            }
+        }
+
+        session.writePlan(plan);
+    }
+
+    std::vector<Action *> actions;
+};
+
+void PloadCommand::addAction(Action * action, ArgReader & argReader)
+{
+    action->parseArguments(argReader);
+    actions.push_back(action);
+}
+
+void PloadCommand::parseArgs(int argc, char ** argv)
+{
+    ArgReader argReader(argc, argv);
+
+    while (1)
+    {
+        const char * argCStr = argReader.next();
+
+        if (argCStr == NULL)
+        {
+            break;  // Done reading arguments.
+        }
+
+        std::string arg = argCStr;
+
+        if (arg == "-t")
+        {
+            const char * s = argReader.next();
+            if (s == NULL)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "Expected a device type after '" + std::string(argReader.last()) + "'.");
+            }
+            const PloaderUserType * userType = ploaderUserTypeLookup(s);
+            if (userType == NULL)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "Invalid device type '" + std::string(s) + "'.");
+            }
+            selector.specifyUserType(*userType);
+            stationJob.typeName = s;
+        }
+        else if (arg == "-d")
+        {
+            if (selector.serialNumberWasSpecified())
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "A serial number can only be specified once.");
+            }
+            const char * s = argReader.next();
+            if (s == NULL)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "Expected a serial number after '" + std::string(argReader.last()) + "'.");
+            }
+            if (s[0] == 0)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "An empty serial number was specified.");
+            }
+            selector.specifySerialNumber(s);
+            stationJob.serialNumber = s;
+        }
+        else if (arg == "--list")
+        {
+            listDevicesFlag = true;
+        }
+        else if (arg == "--list-supported")
+        {
+            listSupportedFlag = true;
+        }
+        else if (arg == "--start-bootloader")
+        {
+            startBootloaderFlag = true;
+        }
+        else if (arg == "--wait")
+        {
+            waitForBootloaderFlag = true;
+        }
+        else if (arg == "--wait-timeout")
+        {
+            const char * s = argReader.next();
+            if (s == NULL)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "Expected a number of seconds after '" + std::string(argReader.last()) + "'.");
+            }
+            char * end;
+            unsigned long seconds = strtoul(s, &end, 10);
+            if (s[0] < '0' || s[0] > '9' || *end != 0 || seconds > 3600)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "Invalid wait timeout '" + std::string(s) + "'.");
+            }
+            waitTimeoutMs = seconds * 1000;
+        }
+        else if (arg == "--all")
+        {
+            allDevicesFlag = true;
+        }
+        else if (arg == "-w")
+        {
+            addAction(new ActionWriteMemory(MEMORY_SET_ALL), argReader);
+            restartBootloaderFlag = true;
+        }
+        else if (arg == "--write")
+        {
+            addAction(new ActionWriteMemory(MEMORY_SET_ALL), argReader);
+        }
+        else if (arg == "--write-flash")
+        {
+            addAction(new ActionWriteMemory(MEMORY_SET_FLASH), argReader);
+        }
+        else if (arg == "--write-eeprom")
+        {
+            addAction(new ActionWriteMemory(MEMORY_SET_EEPROM), argReader);
+        }
+        else if (arg == "--write-if-different")
+        {
+            writeOptions.writeIfDifferent = true;
+        }
+        else if (arg == "--verify")
+        {
+            writeOptions.verify = true;
+        }
+        else if (arg == "--ledger")
+        {
+            const char * s = argReader.next();
+            if (s == NULL)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "Expected a file name after '" + std::string(argReader.last()) + "'.");
+            }
+            writeOptions.ledgerFileName = s;
+        }
+        else if (arg == "--skip-if-recorded")
+        {
+            writeOptions.skipIfRecorded = true;
+        }
+        else if (arg == "--erase")
+        {
+            addAction(new ActionEraseMemory(MEMORY_SET_ALL), argReader);
+        }
+        else if (arg == "--erase-flash")
+        {
+            addAction(new ActionEraseMemory(MEMORY_SET_FLASH), argReader);
+        }
+        else if (arg == "--erase-eeprom")
+        {
+            addAction(new ActionEraseMemory(MEMORY_SET_EEPROM), argReader);
+        }
+        else if (arg == "--read")
+        {
+            addAction(new ActionReadMemory(MEMORY_SET_ALL), argReader);
+        }
+        else if (arg == "--read-flash")
+        {
+            addAction(new ActionReadMemory(MEMORY_SET_FLASH), argReader);
+        }
+        else if (arg == "--read-eeprom")
+        {
+            addAction(new ActionReadMemory(MEMORY_SET_EEPROM), argReader);
+        }
+        else if (arg == "--patch-eeprom")
+        {
+            if (!actions.empty() && actions.back() == patchAction)
+            {
+                patchAction->parseArguments(argReader);
+            }
+            else
+            {
+                patchAction = new ActionPatchEeprom();
+                addAction(patchAction, argReader);
+            }
+        }
+        else if (arg == "--audit")
+        {
+            if (auditFlag)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "The --audit option can only be specified once.");
+            }
+            auditFlag = true;
+            addAction(new ActionAudit(), argReader);
         }
         else if (arg == "--restart")
         {
-            restartBootloaderFlag = true;
+            restartBootloaderFlag = true;
+        }
+        else if (arg == "--pause")
+        {
+            pauseFlag = true;
+        }
+        else if (arg == "--pause-on-error")
+        {
+            pauseOnErrorFlag = true;
+        }
+        else if (arg == "--simulate")
+        {
+            const char * s = argReader.next();
+            if (s == NULL)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "Expected simulation settings after '" + std::string(argReader.last()) + "'.");
+            }
+            try
+            {
+                ploaderSetBus(PloaderSimBus::create(s));
+            }
+            catch(const std::runtime_error & error)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS, error.what());
+            }
+        }
+        else if (arg == "--daemon" || arg == "--connect")
+        {
+            const char * s = argReader.next();
+            if (s == NULL)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "Expected a socket path after '" + std::string(argReader.last()) + "'.");
+            }
+            if (!stationSocketPath.empty())
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "Only one of --daemon or --connect can be specified, once.");
+            }
+            stationSocketPath = s;
+            daemonFlag = arg == "--daemon";
+        }
+        else if (arg == "--trace")
+        {
+            const char * s = argReader.next();
+            if (s == NULL)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "Expected a file name after '" + std::string(argReader.last()) + "'.");
+            }
+            traceFileName = s;
+            traceStart();
+        }
+        else if (arg == "--stats")
+        {
+            transferStatsStart();
+        }
+        else if (arg == "-h" || arg == "--help")
+        {
+            showHelpFlag = true;
+        }
+        else
+        {
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                std::string("Unknown option: '") + arg + "'.");
+        }
+    }
+
+    if (!someCommandSpecified())
+    {
+        throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+            "Arguments do not specify anything to do.");
+    }
+
+    if (daemonFlag)
+    {
+        if (actions.size() > 0 || restartBootloaderFlag ||
+            selector.serialNumberWasSpecified() || selector.userTypeWasSpecified())
+        {
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                "The daemon gets the devices and files to use from its jobs.");
+        }
+    }
+    else if (!stationSocketPath.empty())
+    {
+        if (actions.size() != 1 || !actions[0]->addToStationJob(stationJob))
+        {
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                "With --connect, specify exactly one write option.");
+        }
+        stationJob.restart = restartBootloaderFlag;
+    }
+
+    if (!stationSocketPath.empty() &&
+        (allDevicesFlag || startBootloaderFlag || listDevicesFlag ||
+        writeOptions.writeIfDifferent || writeOptions.verify ||
+        !writeOptions.ledgerFileName.empty()))
+    {
+        throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+            "The --all, --start-bootloader, --list, --write-if-different, "
+            "--verify, and --ledger options are not supported with --daemon or "
+            "--connect.");
+    }
+
+    if (writeOptions.skipIfRecorded && writeOptions.ledgerFileName.empty())
+    {
+        throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+            "The --skip-if-recorded option requires --ledger.");
+    }
+
+    // An audit covers every matching device unless -d picks one.
+    if (auditFlag && !selector.serialNumberWasSpecified())
+    {
+        allDevicesFlag = true;
+    }
+
+    if (allDevicesFlag)
+    {
+        if (selector.serialNumberWasSpecified())
+        {
+            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                "The --all option cannot be used with -d.");
         }
-        else if (arg == "--pause")
+
+        for (const Action * action : actions)
         {
-            pauseFlag = true;
+            if (!action->supportsMultipleDevices())
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "Reading from devices is not supported with --all.");
+            }
         }
-        else if (arg == "--pause-on-error")
+    }
+}
+
+/* Reads the files for the actions.  Normally this happens on a background
+ * thread, so that parsing large files overlaps with starting the bootloader
+ * and waiting for it to appear, and finish() must be called before the
+ * actions use their data.  If no type was specified with -t, the device
+ * selector needs the firmware data to infer the type (e.g. from the images in
+ * an FMI file) before it can look for devices, so the files are read right
+ * away instead.  With -t, DeviceSelector::specifyFirmwareData would ignore
+ * the data, so we do not need to call it. */
+class ActionFileReader
+{
+public:
+    ActionFileReader(const std::vector<Action *> & actions,
+        DeviceSelector & selector)
+        : actions(actions), selector(selector)
+    {
+    }
+
+    ~ActionFileReader()
+    {
+        // If we are leaving because of an error elsewhere, the thread still
+        // has to finish before the actions get deleted.
+        if (thread.joinable())
         {
-            pauseOnErrorFlag = true;
+            thread.join();
         }
-        else if (arg == "-h" || arg == "--help")
+    }
+
+    void start()
+    {
+        // Opening a file is quick, and a file that is missing should be
+        // reported before we start any bootloaders, so only the parsing is
+        // left for the thread.
+        for (Action * action : actions)
         {
-            showHelpFlag = true;
+            action->openFiles();
         }
-        else
+
+        if (!selector.userTypeWasSpecified())
         {
-            throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
-                std::string("Unknown option: '") + arg + "'.");
+            readFiles();
+            for (Action * action : actions)
+            {
+                action->specifyFirmwareData(selector);
+            }
+            return;
         }
+
+        thread = std::thread([this]()
+        {
+            try
+            {
+                readFiles();
+            }
+            catch(...)
+            {
+                error = std::current_exception();
+            }
+        });
     }
 
-    if (!someCommandSpecified())
+    // Waits for the files to be read, and throws the error from reading them
+    // if there was one.  This can be called more than once.
+    void finish()
     {
-        throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
-            "Arguments do not specify anything to do.");
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+
+        if (error)
+        {
+            std::exception_ptr e = error;
+            error = std::exception_ptr();
+            std::rethrow_exception(e);
+        }
+    }
+
+private:
+    void readFiles()
+    {
+        TraceSpan span("read-files");
+        for (Action * action : actions)
+        {
+            action->readFiles();
+        }
+    }
+
+    const std::vector<Action *> & actions;
+    DeviceSelector & selector;
+    std::thread thread;
+    std::exception_ptr error;
+};
+
+/* In gang mode (--all), every qualifying device gets its own GangDevice
+ * object and its own worker thread, which opens a handle to the bootloader and
+ * runs the actions on it.  The actions only read their own state while
+ * executing, so they can safely be shared between the workers. */
+
+class GangStatusListener : public PloaderStatusListener
+{
+public:
+    GangStatusListener(std::string serialNumber, Output & output,
+        std::mutex & outputMutex)
+        : serialNumber(serialNumber), output(output), outputMutex(outputMutex)
+    {
+    }
+
+    // Progress bars from several devices would overwrite each other, so we
+    // just print a line whenever the status message of a device changes.
+    void setStatus(const char * status, uint32_t, uint32_t) override
+    {
+        if (currentMessage == status) { return; }
+        currentMessage = status;
+
+        if (!output.shouldPrintInfo()) { return; }
+        std::lock_guard<std::mutex> lock(outputMutex);
+        std::cout << serialNumber << ": " << status << std::endl;
+    }
+
+private:
+    std::string serialNumber;
+    std::string currentMessage;
+    Output & output;
+    std::mutex & outputMutex;
+};
+
+class GangDevice
+{
+public:
+    GangDevice(std::string serialNumber, std::string name, Output & output,
+        std::mutex & outputMutex)
+        : serialNumber(serialNumber), name(name),
+          listener(serialNumber, output, outputMutex), exitCode(0)
+    {
+    }
+
+    std::string serialNumber;
+    std::string name;
+    PloaderInstance instance;
+    GangStatusListener listener;
+    std::thread thread;
+
+    // The result of the operation, filled in by the worker thread.
+    uint8_t exitCode;
+    std::string errorMessage;
+
+    void fail(uint8_t code, std::string message)
+    {
+        exitCode = code;
+        errorMessage = message;
+    }
+};
+
+void PloadCommand::gangWorker(GangDevice * device)
+{
+    TraceSpan span("device", device->serialNumber.c_str(),
+        device->name.c_str());
+
+    try
+    {
+        PloadSession session;
+        sessionOpen(session, device->instance, device->listener);
+
+        for (Action * action : actions)
+        {
+            action->ensureBootloaderCompatibility(session);
+        }
+
+        for (Action * action : actions)
+        {
+            action->execute(session);
+        }
+
+        if (restartBootloaderFlag)
+        {
+            session.restart();
+            device->listener.setStatus("Sent command to restart device.", 0, 0);
+        }
+    }
+    catch(const ExceptionWithExitCode & error)
+    {
+        device->fail(error.getCode(), error.what());
+    }
+    catch(const std::exception & error)
+    {
+        device->fail(PLOAD_ERROR_OPERATION_FAILED, error.what());
+    }
+}
+
+void PloadCommand::gangPrintInfo(const char * message)
+{
+    std::lock_guard<std::mutex> lock(gangOutputMutex);
+    output.printInfo(message);
+}
+
+// Sends the command to start the bootloader to all of the selected apps at
+// once, and returns the serial numbers of the devices that we expect to see
+// in bootloader mode afterwards.  Devices that fail to launch are added to the
+// results as failures instead of stopping the others.
+std::set<std::string> PloadCommand::gangLaunchBootloaders(
+    GangDeviceList & devices)
+{
+    std::set<std::string> expected;
+
+    for (PloaderAppInstance & app : selector.listApps())
+    {
+        try
+        {
+            app.launchBootloader();
+            expected.insert(app.serialNumber);
+        }
+        catch(const std::exception & error)
+        {
+            devices.emplace_back(new GangDevice(app.serialNumber,
+                app.type.name, output, gangOutputMutex));
+            devices.back()->fail(PLOAD_ERROR_OPERATION_FAILED, error.what());
+        }
+    }
+
+    if (!expected.empty())
+    {
+        output.printInfo("Sent command to start bootloaders.");
+    }
+
+    return expected;
+}
+
+/* Tracks which bootloaders have appeared while we wait for a set of devices to
+ * get into bootloader mode.  Each call to poll() enumerates the USB devices
+ * once, no matter how many devices we are waiting for. */
+class BootloaderWaiter
+{
+public:
+    // If needAny is true, we also wait until at least one bootloader appears,
+    // even if we are not expecting any particular device.
+    BootloaderWaiter(DeviceSelector & selector,
+        const std::set<std::string> & expected, bool needAny)
+        : selector(selector), pending(expected), needAny(needAny)
+    {
+    }
+
+    // Returns the bootloaders that have appeared since the last call.
+    std::vector<PloaderInstance> poll()
+    {
+        std::vector<PloaderInstance> arrived;
+        for (const PloaderInstance & instance : selector.listBootloaders())
+        {
+            if (seen.insert(instance.serialNumber).second)
+            {
+                pending.erase(instance.serialNumber);
+                arrived.push_back(instance);
+            }
+        }
+        return arrived;
+    }
+
+    bool done() const
+    {
+        return pending.empty() && (!needAny || !seen.empty());
+    }
+
+    // The serial numbers of the expected devices that have not appeared yet.
+    const std::set<std::string> & pendingSerialNumbers() const
+    {
+        return pending;
+    }
+
+private:
+    DeviceSelector & selector;
+    std::set<std::string> pending;
+    std::set<std::string> seen;
+    bool needAny;
+};
+
+static void joinGangWorkers(GangDeviceList & devices)
+{
+    for (std::unique_ptr<GangDevice> & device : devices)
+    {
+        if (device->thread.joinable())
+        {
+            device->thread.join();
+        }
+    }
+}
+
+void PloadCommand::printGangResults(const GangDeviceList & devices)
+{
+    output.startNewLine();
+    for (const std::unique_ptr<GangDevice> & device : devices)
+    {
+        printListItem(device->serialNumber, device->name,
+            device->exitCode ? "Error: " + device->errorMessage : "OK");
+    }
+}
+
+// Runs the actions on every qualifying device at the same time.  Each device
+// gets handed to its worker as soon as its bootloader appears, so the devices
+// that are ready do not wait for the rest.  Throws an exception at the end if
+// the actions failed on any of the devices.
+void PloadCommand::runGang(ActionFileReader & fileReader)
+{
+    GangDeviceList devices;
+
+    BootloaderWaiter waiter(selector, gangLaunchBootloaders(devices),
+        waitForBootloaderFlag);
+
+    try
+    {
+        bool printedWaiting = false;
+
+        TraceSpan span("wait-for-bootloader");
+        DeviceWaitLoop waitLoop(selector, waitTimeoutMs);
+        waitLoop.waitUntil([&]()
+        {
+            for (const PloaderInstance & instance : waiter.poll())
+            {
+                // The workers need the data from the files.
+                fileReader.finish();
+
+                devices.emplace_back(new GangDevice(instance.serialNumber,
+                    instance.type.name, output, gangOutputMutex));
+                devices.back()->instance = instance;
+                devices.back()->thread = std::thread(&PloadCommand::gangWorker,
+                    this, devices.back().get());
+            }
+
+            if (waiter.done())
+            {
+                return true;
+            }
+
+            if (!printedWaiting)
+            {
+                gangPrintInfo("Waiting for bootloaders...");
+                printedWaiting = true;
+            }
+            return false;
+        });
+    }
+    catch(...)
+    {
+        // Let the workers that already started finish before reporting the
+        // error, since their threads cannot be abandoned.
+        joinGangWorkers(devices);
+        throw;
+    }
+
+    fileReader.finish();
+
+    // Any expected device that did not show up in bootloader mode in time is
+    // considered to have failed.
+    for (const std::string & serialNumber : waiter.pendingSerialNumbers())
+    {
+        devices.emplace_back(new GangDevice(serialNumber, "?",
+            output, gangOutputMutex));
+        devices.back()->fail(PLOAD_ERROR_DEVICE_NOT_FOUND,
+            "Bootloader did not appear.");
+    }
+
+    if (devices.empty())
+    {
+        throw selector.deviceNotFoundError();
+    }
+
+    joinGangWorkers(devices);
+
+    printGangResults(devices);
+
+    for (const std::unique_ptr<GangDevice> & device : devices)
+    {
+        if (device->exitCode == 0) { continue; }
+        for (Action * action : actions)
+        {
+            action->deviceFailed(device->serialNumber, device->exitCode,
+                device->errorMessage);
+        }
+    }
+
+    for (Action * action : actions)
+    {
+        action->writeFiles(output);
+    }
+
+    // Exit with the code from the first device that failed.
+    uint8_t exitCode = 0;
+    size_t failureCount = 0;
+    for (const std::unique_ptr<GangDevice> & device : devices)
+    {
+        if (device->exitCode == 0) { continue; }
+        if (failureCount == 0) { exitCode = device->exitCode; }
+        failureCount++;
+    }
+
+    if (failureCount)
+    {
+        throw ExceptionWithExitCode(exitCode,
+            std::to_string(failureCount) + " of " +
+            std::to_string(devices.size()) + " devices failed.");
+    }
+}
+
+// Replaces each run of two or more actions that can be fused with one
+// ActionWriteSession, so that they share a single initialization, erase, and
+// write.  For example, "--erase --write app.hex" only erases flash once, and
+// "--write-eeprom a.hex --write-flash b.hex" writes both in one pass.
+void PloadCommand::planActions()
+{
+    std::vector<Action *> planned;
+    size_t start = 0;
+    while (start < actions.size())
+    {
+        size_t end = start;
+        while (end < actions.size() && actions[end]->canBeFused())
+        {
+            end++;
+        }
+
+        if (end - start >= 2)
+        {
+            planned.push_back(new ActionWriteSession(std::vector<Action *>(
+                actions.begin() + start, actions.begin() + end)));
+            start = end;
+        }
+        else
+        {
+            planned.push_back(actions[start]);
+            start++;
+        }
     }
+    actions = planned;
 }
 
-static void run(int argc, char ** argv)
+void PloadCommand::run(int argc, char ** argv)
 {
     parseArgs(argc, argv);
 
+    planActions();
+
     if (showHelpFlag)
     {
         std::cout << help;
@@ -580,9 +1860,25 @@ static void run(int argc, char ** argv)
         return;
     }
 
-    for (Action * action : actions)
+    if (daemonFlag)
+    {
+        stationRunDaemon(stationSocketPath, waitTimeoutMs);
+        return;
+    }
+
+    if (!stationSocketPath.empty())
     {
-        action->readFiles();
+        stationSubmitJob(stationSocketPath, stationJob);
+        return;
+    }
+
+    ActionFileReader fileReader(actions, selector);
+    fileReader.start();
+
+    if (allDevicesFlag && bootloaderHandleNeeded())
+    {
+        runGang(fileReader);
+        return;
     }
 
     bool launchedBootloader = launchBootloaderIfNeeded();
@@ -592,41 +1888,62 @@ static void run(int argc, char ** argv)
         waitForBootloader();
     }
 
+    fileReader.finish();
+
     if (bootloaderHandleNeeded())
     {
-        PloaderHandle handle = bootloaderHandleOpen();
+        PloadSession session;
+        bootloaderSessionOpen(session);
 
         for (Action * action : actions)
         {
-            action->ensureBootloaderCompatibility(handle);
+            action->ensureBootloaderCompatibility(session);
         }
 
         for (Action * action : actions)
         {
-            action->execute(handle);
+            action->execute(session);
         }
 
         for (Action * action : actions)
         {
-            action->writeFiles();
+            action->writeFiles(output);
         }
 
         if (restartBootloaderFlag)
         {
-            restartBootloader(handle);
+            restartBootloader(session);
         }
     }
 }
 
-// main: This is the first function to run when this utility is started.
-int main(int argc, char ** argv)
+// Saves the spans recorded for --trace and prints a summary of them.
+void PloadCommand::writeTrace()
 {
-#if defined(_MSC_VER) && defined(_DEBUG)
-    // For a Debug build in Windows, send a report of memory leaks to
-    // the Debug pane of the Output window in Visual Studio.
-    _CrtSetDbgFlag(_CRTDBG_ALLOC_MEM_DF | _CRTDBG_LEAK_CHECK_DF);
-#endif
+    // Keep the summary out of the way if the trace is going to stdout.
+    output.startNewLine();
+    std::ostream & summaryStream = traceFileName == "-" ? std::cerr : std::cout;
+    summaryStream << traceSummary() << std::endl;
+
+    std::shared_ptr<std::ostream> file = openFileOrPipeOutput(traceFileName);
+    traceWrite(*file);
+    file->flush();
+    if (file->fail())
+    {
+        throw std::runtime_error(traceFileName + ": error writing.");
+    }
+}
+
+PloadCommand::~PloadCommand()
+{
+    for (Action * action : actions)
+    {
+        delete action;
+    }
+}
 
+int PloadCommand::main(int argc, char ** argv)
+{
     if (argc <= 1)
     {
         std::cout << help;
@@ -652,12 +1969,26 @@ int main(int argc, char ** argv)
         exitCode = PLOAD_ERROR_OPERATION_FAILED;
     }
 
-    // Free the memory for the actions.
-    for (Action * action : actions)
+    if (traceEnabled)
     {
-        delete action;
+        try
+        {
+            writeTrace();
+        }
+        catch(const std::exception & error)
+        {
+            std::cerr << "Error: " << error.what() << std::endl;
+            if (exitCode == 0) { exitCode = PLOAD_ERROR_OPERATION_FAILED; }
+        }
+        traceStop();
+    }
+
+    if (transferStatsEnabled)
+    {
+        output.startNewLine();
+        transferStatsWrite(traceFileName == "-" ? std::cerr : std::cout);
+        transferStatsStop();
     }
-    actions.clear();
 
     if (pauseFlag || (pauseOnErrorFlag && exitCode))
     {
@@ -668,3 +1999,9 @@ int main(int argc, char ** argv)
 
     return exitCode;
 }
+
+int ploadMain(int argc, char ** argv)
+{
+    PloadCommand command;
+    return command.main(argc, argv);
+}
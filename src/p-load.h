@@ -39,18 +39,34 @@
 #include <iomanip>
 #include <fstream>
 #include <sstream>
+#include <memory>
+#include <set>
+#include <map>
+#include <algorithm>
+#include <thread>
+#include <mutex>
 
 #include <libusbp.hpp>
 
+typedef std::vector<uint8_t> MemoryImage;
+
 #include "version.h"
 #include "exit_codes.h"
 #include "output.h"
 #include "arg_reader.h"
 #include "ploader.h"
+#include "ploader_sim.h"
+#include "ploader_async.h"
 #include "device_selector.h"
+#include "device_monitor.h"
 #include "intel_hex.h"
 #include "firmware_archive.h"
 #include "firmware_data.h"
 #include "file_utils.h"
+#include "trace.h"
+#include "transfer_stats.h"
+#include "ledger.h"
 
-typedef std::vector<uint8_t> MemoryImage;
+/* Runs p-load with the specified command-line arguments and returns the exit
+ * code.  This is defined in p-load.cpp and called by main. */
+int ploadMain(int argc, char ** argv);
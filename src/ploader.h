@@ -3,6 +3,7 @@
 #include "p-load.h"
 #include <vector>
 #include "firmware_archive.h"
+#include "sparse_image.h"
 
 #define UPLOAD_TYPE_STANDARD 0
 #define UPLOAD_TYPE_DEVICE_SPECIFIC 1
@@ -39,6 +40,49 @@ public:
 
 extern const std::vector<PloaderAppType> ploaderAppTypes;
 
+/** An error from a control transfer.  If the device rejected the request by
+ * responding with a STALL packet, a bootloader can usually tell us why. */
+class PloaderTransferError : public std::runtime_error
+{
+public:
+    PloaderTransferError(std::string message, bool stall = false)
+        : std::runtime_error(message), stall(stall)
+    {
+    }
+
+    bool isStall() const { return stall; }
+
+private:
+    bool stall;
+};
+
+/** A connection to a device that we can send control transfers to.  The
+ * normal transport uses libusbp, and ploader_sim.h provides a simulated one.
+ * Errors are reported by throwing a PloaderTransferError. */
+class PloaderTransport
+{
+public:
+    virtual ~PloaderTransport() { }
+
+    virtual void controlTransfer(uint8_t requestType, uint8_t request,
+        uint16_t value, uint16_t index, void * buffer = NULL,
+        uint16_t length = 0, size_t * transferred = NULL) = 0;
+};
+
+/** Returns a short name for a bootloader or app request code (e.g.
+ * "write-flash"), or NULL if the code is not one that p-load uses. */
+const char * ploaderRequestName(uint8_t request);
+
+/** Refers to the interface of a specific device that we found while listing
+ * devices, and can open a transport to it. */
+class PloaderPort
+{
+public:
+    virtual ~PloaderPort() { }
+
+    virtual std::shared_ptr<PloaderTransport> open() = 0;
+};
+
 /** Represents a specific device connected to the system
  * that we could use to start a bootloader. */
 class PloaderAppInstance
@@ -52,21 +96,21 @@ public:
     }
 
     PloaderAppInstance(const PloaderAppType type,
-        libusbp::generic_interface gi,
+        std::shared_ptr<PloaderPort> port,
         std::string serialNumber)
-        : type(type), serialNumber(serialNumber), usbInterface(gi)
+        : type(type), serialNumber(serialNumber), port(port)
     {
     }
 
     operator bool() const
     {
-        return usbInterface;
+        return port != NULL;
     }
 
     void launchBootloader();
 
 private:
-    libusbp::generic_interface usbInterface;
+    std::shared_ptr<PloaderPort> port;
 };
 
 /** Represents a type of bootloader. */
@@ -162,18 +206,18 @@ public:
     }
 
     PloaderInstance(const PloaderType type,
-        libusbp::generic_interface gi,
+        std::shared_ptr<PloaderPort> port,
         std::string serialNumber)
-        : type(type), serialNumber(serialNumber), usbInterface(gi)
+        : type(type), serialNumber(serialNumber), port(port)
     {
     }
 
     operator bool()
     {
-        return usbInterface;
+        return port != NULL;
     }
 
-    libusbp::generic_interface usbInterface;
+    std::shared_ptr<PloaderPort> port;
 };
 
 /* Represents a high-level device type or device family that can be used in
@@ -206,6 +250,38 @@ const PloaderType * ploaderTypeLookup(uint16_t usbVendorId, uint16_t usbProductI
 
 const PloaderUserType * ploaderUserTypeLookup(std::string codeName);
 
+/** The known apps and bootloaders that were connected to the computer when
+ * the USB devices were enumerated. */
+class DeviceSnapshot
+{
+public:
+    std::vector<PloaderAppInstance> apps;
+    std::vector<PloaderInstance> bootloaders;
+};
+
+/** Enumerates the USB devices once and sorts the known apps and bootloaders
+ * into a snapshot. */
+DeviceSnapshot ploaderListDevices();
+
+/** A source of devices for ploaderListDevices. */
+class PloaderBus
+{
+public:
+    virtual ~PloaderBus() { }
+
+    virtual DeviceSnapshot listDevices() = 0;
+};
+
+/** Makes ploaderListDevices get its devices from the specified bus (e.g. a
+ * simulator) instead of USB.  Passing NULL goes back to USB.  This is a
+ * setting of the whole process, so it should be done before any sessions or
+ * handles are opened: it is safe to call at any time, but devices that were
+ * already listed or opened stay on the old bus. */
+void ploaderSetBus(std::shared_ptr<PloaderBus> bus);
+
+/** Returns true if ploaderListDevices is listing real USB devices. */
+bool ploaderBusIsUsb();
+
 /** Detects all the known apps that are currently connected to the computer.  */
 std::vector<PloaderAppInstance> ploaderListApps();
 
@@ -225,9 +301,9 @@ class PloaderHandle
 public:
     PloaderHandle(PloaderInstance);
 
-    PloaderHandle() { }
+    PloaderHandle() : type(), listener(NULL) { }
 
-    operator bool() const noexcept { return handle; }
+    operator bool() const noexcept { return transport != NULL; }
 
     void close()
     {
@@ -250,11 +326,24 @@ public:
      * you will need to initialize and erase. */
     void writeFlash(const uint8_t * image);
 
+    /** Writes the non-blank blocks of a sparse image that fall within the app
+     * region to flash.  Before doing this, you will need to initialize and
+     * erase. */
+    void writeFlash(const SparseImage & image);
+
     /** Takes care of all the details of reading an app image from the flash on
      * a device.  image must be a pointer to a memory block of the right size which
      * will be written to by this function.  This function takes care of getting the
-     * Wixel in to bootloader mode (if needed) and reading the image. */
-    void readFlash(uint8_t * image);
+     * Wixel in to bootloader mode (if needed) and reading the image.
+     * The status is the message reported to the status listener. */
+    void readFlash(uint8_t * image, const char * status = "Reading flash...");
+
+    /** Reads size bytes of flash starting at the specified address (in the
+     * address space used by the bootloader) into data.  The requests are the
+     * same ones that readFlash sends, so the bootloader accepts them, but only
+     * the ones that overlap the range are sent. */
+    void readFlashRange(uint32_t address, uint32_t size, uint8_t * data,
+        const char * status = "Reading flash...");
 
     /** Erases the EEPROM (sets to 0xFF). **/
     void eraseEeprom();
@@ -262,8 +351,25 @@ public:
     /** Just like writeFlash, but for EEPROM instead */
     void writeEeprom(const uint8_t * image);
 
+    /** Like writeEeprom, but reads each block of EEPROM first and only writes
+     * the blocks that differ from the image.  This is usually faster, and it
+     * wears the EEPROM less.  Returns the number of blocks that were skipped
+     * and reports it to the status listener. */
+    uint32_t writeEepromChanges(const uint8_t * image);
+
+    /** Changes some bytes of EEPROM and leaves the others alone.  The patch
+     * holds the new bytes at their EEPROM addresses (in the address space
+     * used by the bootloader).  Only the blocks that contain patched bytes are
+     * read, and only the ones whose contents change are written.  Returns the
+     * number of blocks written. */
+    uint32_t patchEeprom(const SparseImage & patch);
+
     /** Just like readFlash, but for EEPROM instead. */
-    void readEeprom(uint8_t * image);
+    void readEeprom(uint8_t * image, const char * status = "Reading EEPROM...");
+
+    /** Just like readFlashRange, but for EEPROM instead. */
+    void readEepromRange(uint32_t address, uint32_t size, uint8_t * data,
+        const char * status = "Reading EEPROM...");
 
     /** Sends the Restart command, which causes the device device to reset.  This is
      * usually used to allow a newly-loaded application to start running. */
@@ -277,23 +383,41 @@ public:
      * image to the device. */
     void applyImage(const FirmwareArchive::Image & image);
 
+    /** Sends a status message without any progress to the status listener,
+     * if there is one. */
+    void reportStatus(const char * status);
+
+    /** The number of bytes of EEPROM read or written by each request. */
+    static const uint32_t eepromBlockSize = 32;
+
+    /** The number of bytes of flash read by each request. */
+    static const uint32_t flashReadBlockSize = 1024;
+
     PloaderType type;
 
+    std::string serialNumber;
+
     void setStatusListener(PloaderStatusListener * listener)
     {
         this->listener = listener;
     }
 
+    PloaderStatusListener * getStatusListener() const
+    {
+        return listener;
+    }
+
 private:
     void writeFlashBlock(const uint32_t address, const uint8_t * data, size_t size);
     void writeEepromBlock(const uint32_t address, const uint8_t * data, size_t size);
+    void readEepromBlock(uint32_t address, uint8_t * data);
     void eraseEepromFirstByte();
 
-    void reportError(const libusbp::error & error, std::string context)
+    void reportError(const PloaderTransferError & error, std::string context)
         __attribute__((noreturn));
 
     PloaderStatusListener * listener;
 
-    libusbp::generic_handle handle;
+    std::shared_ptr<PloaderTransport> transport;
 };
 
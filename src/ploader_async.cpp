@@ -0,0 +1,343 @@
+#include "p-load.h"
+
+static const uint32_t asyncExecutorThreadCount = 8;
+
+PloaderExecutor::PloaderExecutor(uint32_t threadCount) : stopping(false)
+{
+    assert(threadCount > 0);
+    for (uint32_t i = 0; i < threadCount; i++)
+    {
+        threads.push_back(std::thread(&PloaderExecutor::work, this));
+    }
+}
+
+PloaderExecutor::~PloaderExecutor()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    jobAvailable.notify_all();
+    for (std::thread & thread : threads)
+    {
+        thread.join();
+    }
+}
+
+void PloaderExecutor::post(std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(std::move(job));
+    }
+    jobAvailable.notify_one();
+}
+
+void PloaderExecutor::work()
+{
+    while (true)
+    {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            jobAvailable.wait(lock, [this]() { return stopping || !jobs.empty(); });
+            if (jobs.empty()) { return; }
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        job();
+    }
+}
+
+PloaderExecutor & ploaderAsyncExecutor()
+{
+    static PloaderExecutor executor(asyncExecutorThreadCount);
+    return executor;
+}
+
+// The part of an async handle that the queued operations use.  It is also the
+// status listener of the handle, which is how operations get cancelled: the
+// handle reports progress after every block, so this throws from there.
+class PloaderAsyncHandle::State : public PloaderStatusListener,
+    public std::enable_shared_from_this<PloaderAsyncHandle::State>
+{
+public:
+    State(PloaderHandle handle, PloaderExecutor & executor)
+        : handle(handle), executor(executor), running(false),
+          cancelCount(0), operationCancelCount(0), listener(NULL)
+    {
+        this->handle.setStatusListener(this);
+    }
+
+    void setStatus(const char * status, uint32_t progress,
+        uint32_t maxProgress) override
+    {
+        ensureNotCancelled();
+        PloaderStatusListener * l = listener;
+        if (l)
+        {
+            l->setStatus(status, progress, maxProgress);
+        }
+    }
+
+    // An operation is cancelled if cancel was called after it was requested.
+    void ensureNotCancelled() const
+    {
+        if (cancelCount != operationCancelCount)
+        {
+            throw PloaderCancelledError();
+        }
+    }
+
+    // Queues an operation.  Only one operation per handle is given to the
+    // executor at a time, and each one is given back to it when it is done,
+    // so a busy handle cannot keep the other handles waiting.
+    void enqueue(std::function<void()> operation)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(std::move(operation));
+        if (!running)
+        {
+            running = true;
+            postNext();
+        }
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this]() { return !running; });
+    }
+
+    PloaderHandle handle;
+    PloaderExecutor & executor;
+
+    std::mutex mutex;
+    std::condition_variable idle;
+    std::deque<std::function<void()>> queue;
+    bool running;
+
+    // The number of times cancel has been called, and the value it had when
+    // the running operation was requested.
+    std::atomic<uint64_t> cancelCount;
+    uint64_t operationCancelCount;
+
+    std::atomic<PloaderStatusListener *> listener;
+
+private:
+    // Must be called with the mutex locked.
+    void postNext()
+    {
+        std::shared_ptr<State> self = shared_from_this();
+        executor.post([self]() { self->runNext(); });
+    }
+
+    void runNext()
+    {
+        std::function<void()> operation;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            operation = std::move(queue.front());
+            queue.pop_front();
+        }
+
+        operation();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (queue.empty())
+        {
+            running = false;
+            idle.notify_all();
+        }
+        else
+        {
+            postNext();
+        }
+    }
+};
+
+PloaderAsyncHandle::PloaderAsyncHandle(PloaderHandle handle,
+    PloaderExecutor & executor)
+    : state(std::make_shared<State>(handle, executor)),
+      type(handle.type), serialNumber(handle.serialNumber)
+{
+}
+
+PloaderAsyncHandle::~PloaderAsyncHandle()
+{
+    wait();
+}
+
+void PloaderAsyncHandle::setStatusListener(PloaderStatusListener * listener)
+{
+    state->listener = listener;
+}
+
+void PloaderAsyncHandle::cancel()
+{
+    state->cancelCount++;
+}
+
+void PloaderAsyncHandle::wait()
+{
+    state->wait();
+}
+
+// Sets the value of a promise to the result of a function, with a special
+// case for functions that return nothing.
+template <typename Result>
+static void fulfill(std::promise<Result> & promise,
+    const std::function<Result(PloaderHandle &)> & function,
+    PloaderHandle & handle)
+{
+    promise.set_value(function(handle));
+}
+
+template <>
+void fulfill(std::promise<void> & promise,
+    const std::function<void(PloaderHandle &)> & function,
+    PloaderHandle & handle)
+{
+    function(handle);
+    promise.set_value();
+}
+
+template <typename Result>
+std::future<Result> PloaderAsyncHandle::submit(
+    std::function<Result(PloaderHandle &)> function)
+{
+    std::shared_ptr<std::promise<Result>> promise =
+        std::make_shared<std::promise<Result>>();
+    std::future<Result> future = promise->get_future();
+
+    State * s = state.get();
+    uint64_t cancelCount = s->cancelCount;
+    s->enqueue([s, promise, function, cancelCount]()
+    {
+        s->operationCancelCount = cancelCount;
+        try
+        {
+            s->ensureNotCancelled();
+            fulfill(*promise, function, s->handle);
+        }
+        catch (...)
+        {
+            promise->set_exception(std::current_exception());
+        }
+    });
+    return future;
+}
+
+std::future<void> PloaderAsyncHandle::initialize(uint16_t uploadType)
+{
+    return submit<void>([uploadType](PloaderHandle & handle)
+    {
+        handle.initialize(uploadType);
+    });
+}
+
+std::future<void> PloaderAsyncHandle::initialize()
+{
+    return submit<void>([](PloaderHandle & handle)
+    {
+        handle.initialize();
+    });
+}
+
+std::future<void> PloaderAsyncHandle::eraseFlash()
+{
+    return submit<void>([](PloaderHandle & handle)
+    {
+        handle.eraseFlash();
+    });
+}
+
+std::future<void> PloaderAsyncHandle::writeFlash(MemoryImage image)
+{
+    if (image.size() != type.appSize)
+    {
+        throw std::runtime_error("The flash image has the wrong size.");
+    }
+    return submit<void>([image](PloaderHandle & handle)
+    {
+        handle.writeFlash(&image[0]);
+    });
+}
+
+std::future<void> PloaderAsyncHandle::writeFlash(SparseImage image)
+{
+    return submit<void>([image](PloaderHandle & handle)
+    {
+        handle.writeFlash(image);
+    });
+}
+
+std::future<MemoryImage> PloaderAsyncHandle::readFlash()
+{
+    return submit<MemoryImage>([](PloaderHandle & handle)
+    {
+        MemoryImage image(handle.type.appSize);
+        handle.readFlash(&image[0]);
+        return image;
+    });
+}
+
+std::future<void> PloaderAsyncHandle::eraseEeprom()
+{
+    return submit<void>([](PloaderHandle & handle)
+    {
+        handle.eraseEeprom();
+    });
+}
+
+std::future<void> PloaderAsyncHandle::writeEeprom(MemoryImage image)
+{
+    if (image.size() != type.eepromSize)
+    {
+        throw std::runtime_error("The EEPROM image has the wrong size.");
+    }
+    return submit<void>([image](PloaderHandle & handle)
+    {
+        handle.writeEeprom(&image[0]);
+    });
+}
+
+std::future<MemoryImage> PloaderAsyncHandle::readEeprom()
+{
+    return submit<MemoryImage>([](PloaderHandle & handle)
+    {
+        MemoryImage image(handle.type.eepromSize);
+        handle.readEeprom(&image[0]);
+        return image;
+    });
+}
+
+std::future<void> PloaderAsyncHandle::restartDevice()
+{
+    return submit<void>([](PloaderHandle & handle)
+    {
+        handle.restartDevice();
+    });
+}
+
+std::future<bool> PloaderAsyncHandle::checkApplication()
+{
+    return submit<bool>([](PloaderHandle & handle)
+    {
+        return handle.checkApplication();
+    });
+}
+
+std::future<void> PloaderAsyncHandle::applyImage(FirmwareArchive::Image image)
+{
+    return submit<void>([image](PloaderHandle & handle)
+    {
+        handle.applyImage(image);
+    });
+}
+
+std::future<void> PloaderAsyncHandle::run(
+    std::function<void(PloaderHandle &)> function)
+{
+    return submit<void>(function);
+}
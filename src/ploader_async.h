@@ -0,0 +1,126 @@
+#pragma once
+
+/* An asynchronous interface to PloaderHandle, for programs that want to drive
+ * many devices from a few threads.  Each operation returns a std::future and
+ * runs on a PloaderExecutor, which limits how many operations run at once.
+ * The operations on one handle run one at a time, in the order they were
+ * requested, while operations on different handles run in parallel. */
+
+#include "p-load.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+
+/* Thrown (through the future) by an operation that was cancelled. */
+class PloaderCancelledError : public std::runtime_error
+{
+public:
+    PloaderCancelledError() : std::runtime_error("Operation cancelled.")
+    {
+    }
+};
+
+/* A fixed pool of threads that run jobs in the order they were posted.  The
+ * number of threads is the maximum number of operations that run at once. */
+class PloaderExecutor
+{
+public:
+    explicit PloaderExecutor(uint32_t threadCount);
+
+    /* Runs the jobs that are still queued, then stops the threads. */
+    ~PloaderExecutor();
+
+    void post(std::function<void()> job);
+
+    uint32_t getThreadCount() const
+    {
+        return threads.size();
+    }
+
+private:
+    PloaderExecutor(const PloaderExecutor &);
+    PloaderExecutor & operator=(const PloaderExecutor &);
+
+    void work();
+
+    std::mutex mutex;
+    std::condition_variable jobAvailable;
+    std::deque<std::function<void()>> jobs;
+    bool stopping;
+    std::vector<std::thread> threads;
+};
+
+/* The executor used by PloaderAsyncHandle unless another one is specified.
+ * It has 8 threads and is created the first time it is used. */
+PloaderExecutor & ploaderAsyncExecutor();
+
+class PloaderAsyncHandle
+{
+public:
+    /* Takes over an open handle.  The handle's status listener is replaced by
+     * the one set with setStatusListener. */
+    explicit PloaderAsyncHandle(PloaderHandle handle,
+        PloaderExecutor & executor = ploaderAsyncExecutor());
+
+    /* Waits for all the requested operations to finish. */
+    ~PloaderAsyncHandle();
+
+    /* Sets the listener that the operations report their progress to.  It is
+     * called on the executor's threads, and must stay valid until the
+     * operations are done. */
+    void setStatusListener(PloaderStatusListener * listener);
+
+    /* Cancels the operation that is running and the ones that are waiting to
+     * run.  The running operation stops at the next block boundary, so the
+     * device might be left partly written or erased.  Operations requested
+     * after this call are not affected. */
+    void cancel();
+
+    /* Waits for all the requested operations to finish. */
+    void wait();
+
+    std::future<void> initialize(uint16_t uploadType);
+    std::future<void> initialize();
+    std::future<void> eraseFlash();
+    std::future<void> writeFlash(MemoryImage image);
+    std::future<void> writeFlash(SparseImage image);
+    std::future<MemoryImage> readFlash();
+    std::future<void> eraseEeprom();
+    std::future<void> writeEeprom(MemoryImage image);
+    std::future<MemoryImage> readEeprom();
+    std::future<void> restartDevice();
+    std::future<bool> checkApplication();
+    std::future<void> applyImage(FirmwareArchive::Image image);
+
+    /* Runs any other function that uses the handle, such as
+     * FirmwareData::writeToBootloader, as one operation.  The function is
+     * cancelled the same way as the built-in operations: at the next point
+     * where the handle reports progress. */
+    std::future<void> run(std::function<void(PloaderHandle &)> function);
+
+    const PloaderType & getType() const
+    {
+        return type;
+    }
+
+    const std::string & getSerialNumber() const
+    {
+        return serialNumber;
+    }
+
+private:
+    PloaderAsyncHandle(const PloaderAsyncHandle &);
+    PloaderAsyncHandle & operator=(const PloaderAsyncHandle &);
+
+    template <typename Result>
+    std::future<Result> submit(std::function<Result(PloaderHandle &)>);
+
+    class State;
+    std::shared_ptr<State> state;
+
+    PloaderType type;
+    std::string serialNumber;
+};
@@ -0,0 +1,35 @@
+#pragma once
+
+/* Constants for the USB protocol used by Pololu bootloaders and by the apps
+ * that can start them.  These are shared by ploader.cpp, which talks to real
+ * devices, and ploader_sim.cpp, which simulates them. */
+
+// Request codes used to talk to the bootloader.
+#define REQUEST_INITIALIZE         0x80
+#define REQUEST_ERASE_FLASH        0x81
+#define REQUEST_WRITE_FLASH_BLOCK  0x82
+#define REQUEST_GET_LAST_ERROR     0x83
+#define REQUEST_CHECK_APPLICATION  0x84
+#define REQUEST_READ_FLASH         0x86
+#define REQUEST_SET_DEVICE_CODE    0x87
+#define REQUEST_READ_EEPROM        0x88
+#define REQUEST_WRITE_EEPROM       0x89
+#define REQUEST_RESTART            0xFE
+
+// Request codes used to talk to a typical native USB app.
+#define REQUEST_START_BOOTLOADER  0xFF
+
+// Error codes returned by REQUEST_ERASE_FLASH and REQUEST_GET_LAST_ERROR.
+#define PLOADER_ERROR_STATE                1
+#define PLOADER_ERROR_LENGTH               2
+#define PLOADER_ERROR_PROGRAMMING          3
+#define PLOADER_ERROR_WRITE_PROTECTION     4
+#define PLOADER_ERROR_VERIFICATION         5
+#define PLOADER_ERROR_ADDRESS_RANGE        6
+#define PLOADER_ERROR_ADDRESS_ORDER        7
+#define PLOADER_ERROR_ADDRESS_ALIGNMENT    8
+#define PLOADER_ERROR_WRITE                9
+#define PLOADER_ERROR_EEPROM_VERIFICATION 10
+
+// Other bootloader constants
+#define DEVICE_CODE_SIZE           16
@@ -0,0 +1,669 @@
+/* Simulated bootloaders for testing and benchmarking p-load without hardware.
+ * See ploader_sim.h. */
+
+#include "ploader_sim.h"
+#include "ploader_protocol.h"
+
+#include <chrono>
+
+// The number of pages that a simulated bootloader erases.  The erase request
+// reports the number of pages left in one byte, so there can be at most 256.
+static const uint32_t maxErasePageCount = 256;
+static const uint32_t minErasePageSize = 1024;
+
+static const uint8_t blankByte = 0xFF;
+
+uint32_t PloaderSimTiming::getRequestUs(uint8_t request) const
+{
+    auto it = requestUs.find(request);
+    if (it == requestUs.end())
+    {
+        return defaultRequestUs;
+    }
+    return it->second;
+}
+
+PloaderSimCounters::PloaderSimCounters() : bytes(0)
+{
+    for (std::atomic<uint32_t> & count : requests)
+    {
+        count = 0;
+    }
+}
+
+static void sleepUs(uint32_t us)
+{
+    if (us)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(us));
+    }
+}
+
+static bool isBlank(const uint8_t * data, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        if (data[i] != blankByte) { return false; }
+    }
+    return true;
+}
+
+class PloaderSimDevice
+    : public std::enable_shared_from_this<PloaderSimDevice>
+{
+public:
+    PloaderSimDevice(const PloaderType & type, std::string serialNumber,
+        bool appMode, const PloaderSimTiming & timing,
+        std::shared_ptr<PloaderSimCounters> counters);
+
+    /* Adds the device to the snapshot if it is connected. */
+    void addToSnapshot(DeviceSnapshot & snapshot);
+
+    /* Throws an exception if the device has disconnected since the specified
+     * connection number was handed out. */
+    void ensureConnected(uint32_t connection);
+
+    void controlTransfer(uint32_t connection, uint8_t requestType,
+        uint8_t request, uint16_t value, uint16_t index, void * buffer,
+        uint16_t length, size_t * transferred);
+
+private:
+    enum Mode
+    {
+        MODE_APP,
+        MODE_BOOTLOADER,
+
+        // Running an app that p-load does not know how to talk to.
+        MODE_OTHER_APP,
+    };
+
+    bool isConnected() const;
+    void reconnect(Mode newMode, uint32_t delayMs);
+    void resetBootloaderState();
+    bool appIsValid() const;
+
+    // Responds with a STALL packet, which is how the bootloader rejects
+    // requests, after recording the error code for REQUEST_GET_LAST_ERROR.
+    void fail(uint8_t errorCode) __attribute__((noreturn));
+
+    size_t handleBootloaderRequest(uint8_t request, uint16_t value,
+        uint16_t index, uint8_t * buffer, uint16_t length);
+    size_t eraseFlashPage(uint8_t * buffer, uint16_t length);
+    size_t writeFlashBlock(uint32_t address, const uint8_t * buffer,
+        uint16_t length);
+    void checkEepromRange(uint32_t address, uint16_t length);
+
+    const PloaderType type;
+    const std::string serialNumber;
+    const PloaderSimTiming timing;
+    const std::shared_ptr<PloaderSimCounters> counters;
+    const uint32_t erasePageSize;
+    const uint32_t erasePageCount;
+
+    std::mutex mutex;
+
+    Mode mode;
+
+    // Incremented every time the device disconnects, so that ports and
+    // transports from an earlier connection stop working.
+    uint32_t connection;
+    std::chrono::steady_clock::time_point connectTime;
+
+    std::vector<uint8_t> flash;
+    std::vector<uint8_t> eeprom;
+
+    // Which write blocks have been written since they were last erased.
+    std::vector<bool> blockWritten;
+
+    bool deviceCodeReceived;
+    bool initialized;
+    uint16_t uploadType;
+    uint32_t erasePagesLeft;
+    bool flashErased;
+    uint8_t lastError;
+};
+
+class PloaderSimTransport : public PloaderTransport
+{
+public:
+    PloaderSimTransport(std::shared_ptr<PloaderSimDevice> device,
+        uint32_t connection)
+        : device(device), connection(connection)
+    {
+    }
+
+    void controlTransfer(uint8_t requestType, uint8_t request,
+        uint16_t value, uint16_t index, void * buffer,
+        uint16_t length, size_t * transferred) override
+    {
+        device->controlTransfer(connection, requestType, request,
+            value, index, buffer, length, transferred);
+    }
+
+private:
+    std::shared_ptr<PloaderSimDevice> device;
+    uint32_t connection;
+};
+
+class PloaderSimPort : public PloaderPort
+{
+public:
+    PloaderSimPort(std::shared_ptr<PloaderSimDevice> device,
+        uint32_t connection)
+        : device(device), connection(connection)
+    {
+    }
+
+    std::shared_ptr<PloaderTransport> open() override
+    {
+        device->ensureConnected(connection);
+        return std::make_shared<PloaderSimTransport>(device, connection);
+    }
+
+private:
+    std::shared_ptr<PloaderSimDevice> device;
+    uint32_t connection;
+};
+
+static uint32_t getErasePageSize(const PloaderType & type)
+{
+    uint32_t size = (type.appSize + maxErasePageCount - 1) / maxErasePageCount;
+    if (size < minErasePageSize) { size = minErasePageSize; }
+    size = (size + type.writeBlockSize - 1) / type.writeBlockSize * type.writeBlockSize;
+    return size;
+}
+
+PloaderSimDevice::PloaderSimDevice(const PloaderType & type,
+    std::string serialNumber, bool appMode, const PloaderSimTiming & timing,
+    std::shared_ptr<PloaderSimCounters> counters)
+    : type(type), serialNumber(serialNumber), timing(timing),
+      counters(counters),
+      erasePageSize(getErasePageSize(type)),
+      erasePageCount((type.appSize + erasePageSize - 1) / erasePageSize),
+      mode(appMode ? MODE_APP : MODE_BOOTLOADER),
+      connection(0),
+      connectTime(std::chrono::steady_clock::now()),
+      flash(type.appSize, blankByte),
+      eeprom(type.eepromSize, blankByte),
+      blockWritten(type.appSize / type.writeBlockSize)
+{
+    if (appMode)
+    {
+        // The device is running an app, so put something in flash that makes
+        // the app look valid.
+        std::fill(flash.begin(), flash.begin() + type.writeBlockSize, 0);
+        blockWritten[0] = true;
+    }
+    resetBootloaderState();
+}
+
+bool PloaderSimDevice::isConnected() const
+{
+    return std::chrono::steady_clock::now() >= connectTime;
+}
+
+void PloaderSimDevice::addToSnapshot(DeviceSnapshot & snapshot)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (!isConnected()) { return; }
+
+    std::shared_ptr<PloaderPort> port =
+        std::make_shared<PloaderSimPort>(shared_from_this(), connection);
+
+    if (mode == MODE_APP)
+    {
+        snapshot.apps.push_back(PloaderAppInstance(
+            type.getMatchingAppTypes().at(0), port, serialNumber));
+    }
+    else if (mode == MODE_BOOTLOADER)
+    {
+        snapshot.bootloaders.push_back(PloaderInstance(
+            type, port, serialNumber));
+    }
+}
+
+void PloaderSimDevice::ensureConnected(uint32_t connection)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (connection != this->connection || !isConnected())
+    {
+        throw PloaderTransferError("The simulated device is not connected.");
+    }
+}
+
+void PloaderSimDevice::reconnect(Mode newMode, uint32_t delayMs)
+{
+    mode = newMode;
+    connection++;
+    connectTime = std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(delayMs);
+    resetBootloaderState();
+}
+
+void PloaderSimDevice::resetBootloaderState()
+{
+    deviceCodeReceived = false;
+    initialized = false;
+    uploadType = 0;
+    erasePagesLeft = 0;
+    flashErased = false;
+    lastError = 0;
+}
+
+bool PloaderSimDevice::appIsValid() const
+{
+    // Like the real bootloaders, just check the beginning of the app.
+    return !isBlank(&flash[0], type.writeBlockSize);
+}
+
+void PloaderSimDevice::fail(uint8_t errorCode)
+{
+    lastError = errorCode;
+    throw PloaderTransferError("The simulated device stalled the request.",
+        true);
+}
+
+void PloaderSimDevice::controlTransfer(uint32_t connection,
+    uint8_t requestType, uint8_t request, uint16_t value, uint16_t index,
+    void * buffer, uint16_t length, size_t * transferred)
+{
+    counters->requests[request]++;
+    sleepUs(timing.getRequestUs(request));
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (connection != this->connection || !isConnected())
+    {
+        throw PloaderTransferError("The simulated device is not connected.");
+    }
+
+    if (length && buffer == NULL)
+    {
+        fail(PLOADER_ERROR_LENGTH);
+    }
+
+    // Each request only works in one direction.
+    bool deviceToHost = requestType & 0x80;
+    bool requestIsIn = request == REQUEST_ERASE_FLASH ||
+        request == REQUEST_GET_LAST_ERROR ||
+        request == REQUEST_CHECK_APPLICATION ||
+        request == REQUEST_READ_FLASH ||
+        request == REQUEST_READ_EEPROM;
+    if ((requestType & 0x7F) != 0x40 || deviceToHost != requestIsIn)
+    {
+        fail(PLOADER_ERROR_STATE);
+    }
+
+    size_t count = 0;
+    if (mode == MODE_APP)
+    {
+        if (request != REQUEST_START_BOOTLOADER)
+        {
+            fail(PLOADER_ERROR_STATE);
+        }
+        reconnect(MODE_BOOTLOADER, timing.reconnectMs);
+    }
+    else
+    {
+        count = handleBootloaderRequest(request, value, index,
+            (uint8_t *)buffer, length);
+    }
+
+    counters->bytes += count;
+    if (transferred)
+    {
+        *transferred = count;
+    }
+}
+
+size_t PloaderSimDevice::handleBootloaderRequest(uint8_t request,
+    uint16_t value, uint16_t index, uint8_t * buffer, uint16_t length)
+{
+    uint32_t address = value | (uint32_t)index << 16;
+
+    switch (request)
+    {
+    case REQUEST_SET_DEVICE_CODE:
+        if (type.deviceCode == NULL)
+        {
+            fail(PLOADER_ERROR_STATE);
+        }
+        if (length != DEVICE_CODE_SIZE)
+        {
+            fail(PLOADER_ERROR_LENGTH);
+        }
+        deviceCodeReceived =
+            memcmp(buffer, type.deviceCode, DEVICE_CODE_SIZE) == 0;
+        return length;
+
+    case REQUEST_INITIALIZE:
+        if (type.deviceCode != NULL && !deviceCodeReceived)
+        {
+            fail(PLOADER_ERROR_STATE);
+        }
+        if (value > UPLOAD_TYPE_PLAIN ||
+            (value == UPLOAD_TYPE_PLAIN && !type.supportsFlashPlainWriting))
+        {
+            fail(PLOADER_ERROR_STATE);
+        }
+        initialized = true;
+        uploadType = value;
+        erasePagesLeft = 0;
+        flashErased = false;
+        return 0;
+
+    case REQUEST_ERASE_FLASH:
+        return eraseFlashPage(buffer, length);
+
+    case REQUEST_WRITE_FLASH_BLOCK:
+        return writeFlashBlock(address, buffer, length);
+
+    case REQUEST_GET_LAST_ERROR:
+        if (length < 1) { fail(PLOADER_ERROR_LENGTH); }
+        buffer[0] = lastError;
+        return 1;
+
+    case REQUEST_CHECK_APPLICATION:
+        if (length < 1) { fail(PLOADER_ERROR_LENGTH); }
+        buffer[0] = appIsValid();
+        return 1;
+
+    case REQUEST_READ_FLASH:
+        if (!type.supportsFlashReading)
+        {
+            fail(PLOADER_ERROR_STATE);
+        }
+        if (address < type.appAddress ||
+            address - type.appAddress + length > type.appSize)
+        {
+            fail(PLOADER_ERROR_ADDRESS_RANGE);
+        }
+        memcpy(buffer, &flash[address - type.appAddress], length);
+        return length;
+
+    case REQUEST_READ_EEPROM:
+        checkEepromRange(address, length);
+        memcpy(buffer, &eeprom[address - type.eepromAddress], length);
+        return length;
+
+    case REQUEST_WRITE_EEPROM:
+        checkEepromRange(address, length);
+        memcpy(&eeprom[address - type.eepromAddress], buffer, length);
+        return length;
+
+    case REQUEST_RESTART:
+    {
+        Mode newMode = MODE_BOOTLOADER;
+        if (appIsValid())
+        {
+            newMode = type.matchingAppTypes.empty() ? MODE_OTHER_APP : MODE_APP;
+        }
+        reconnect(newMode, value + timing.reconnectMs);
+        return 0;
+    }
+
+    default:
+        fail(PLOADER_ERROR_STATE);
+    }
+}
+
+size_t PloaderSimDevice::eraseFlashPage(uint8_t * buffer, uint16_t length)
+{
+    if (length < 2) { fail(PLOADER_ERROR_LENGTH); }
+
+    // Erase errors are reported in the response instead of with a STALL.
+    if (!initialized)
+    {
+        buffer[0] = PLOADER_ERROR_STATE;
+        buffer[1] = 0;
+        return 2;
+    }
+
+    if (erasePagesLeft == 0)
+    {
+        // Start a new erase.
+        erasePagesLeft = erasePageCount;
+        flashErased = false;
+    }
+
+    uint32_t offset = (erasePageCount - erasePagesLeft) * erasePageSize;
+    uint32_t size = std::min(erasePageSize, type.appSize - offset);
+    std::fill(flash.begin() + offset, flash.begin() + offset + size,
+        blankByte);
+    std::fill(blockWritten.begin() + offset / type.writeBlockSize,
+        blockWritten.begin() + (offset + size) / type.writeBlockSize, false);
+    erasePagesLeft--;
+
+    if (erasePagesLeft == 0)
+    {
+        flashErased = true;
+        if (type.erasingFlashAffectsEeprom)
+        {
+            std::fill(eeprom.begin(), eeprom.end(), blankByte);
+        }
+    }
+
+    buffer[0] = 0;
+    buffer[1] = erasePagesLeft;
+    return 2;
+}
+
+size_t PloaderSimDevice::writeFlashBlock(uint32_t address,
+    const uint8_t * buffer, uint16_t length)
+{
+    if (!flashErased)
+    {
+        fail(PLOADER_ERROR_STATE);
+    }
+    if (length != type.writeBlockSize)
+    {
+        fail(PLOADER_ERROR_LENGTH);
+    }
+    if (address < type.appAddress ||
+        address - type.appAddress >= type.appSize)
+    {
+        fail(PLOADER_ERROR_ADDRESS_RANGE);
+    }
+    if ((address - type.appAddress) % type.writeBlockSize)
+    {
+        fail(PLOADER_ERROR_ADDRESS_ALIGNMENT);
+    }
+
+    // Flash cannot be programmed twice without erasing it.
+    uint32_t offset = address - type.appAddress;
+    uint32_t blockIndex = offset / type.writeBlockSize;
+    if (blockWritten[blockIndex])
+    {
+        fail(PLOADER_ERROR_PROGRAMMING);
+    }
+    blockWritten[blockIndex] = true;
+
+    // For the encrypted upload types, we just store the data we receive, since
+    // we do not know the keys.
+    memcpy(&flash[offset], buffer, length);
+    return length;
+}
+
+void PloaderSimDevice::checkEepromRange(uint32_t address, uint16_t length)
+{
+    if (!type.supportsEepromAccess)
+    {
+        fail(PLOADER_ERROR_STATE);
+    }
+    if (address < type.eepromAddress ||
+        address - type.eepromAddress + length > type.eepromSize)
+    {
+        fail(PLOADER_ERROR_ADDRESS_RANGE);
+    }
+}
+
+PloaderSimBus::PloaderSimBus(PloaderSimTiming timing)
+    : timing(timing), counters(std::make_shared<PloaderSimCounters>())
+{
+}
+
+void PloaderSimBus::addDevice(const PloaderType & type,
+    std::string serialNumber, bool appMode)
+{
+    if (appMode && type.matchingAppTypes.empty())
+    {
+        throw std::runtime_error(std::string("The ") + type.name +
+            " does not have an app that can start it.");
+    }
+    devices.push_back(std::make_shared<PloaderSimDevice>(
+        type, serialNumber, appMode, timing, counters));
+}
+
+DeviceSnapshot PloaderSimBus::listDevices()
+{
+    sleepUs(timing.enumerateUs);
+
+    DeviceSnapshot snapshot;
+    for (const std::shared_ptr<PloaderSimDevice> & device : devices)
+    {
+        device->addToSnapshot(snapshot);
+    }
+    return snapshot;
+}
+
+uint32_t PloaderSimBus::getRequestCount(uint8_t request) const
+{
+    return counters->requests[request];
+}
+
+uint64_t PloaderSimBus::getByteCount() const
+{
+    return counters->bytes;
+}
+
+static bool parseNumber(const std::string & s, uint32_t & value)
+{
+    if (s.empty() || s[0] < '0' || s[0] > '9') { return false; }
+    char * end;
+    errno = 0;
+    unsigned long v = strtoul(s.c_str(), &end, 10);
+    if (*end != 0 || errno || v > 0xFFFFFFFF) { return false; }
+    value = v;
+    return true;
+}
+
+std::shared_ptr<PloaderSimBus> PloaderSimBus::create(std::string settings)
+{
+    PloaderSimTiming timing;
+    std::string typeName = "all";
+    uint32_t count = 1;
+    bool appMode = false;
+
+    std::stringstream stream(settings);
+    std::string setting;
+    while (std::getline(stream, setting, ','))
+    {
+        size_t equals = setting.find('=');
+        std::string key = setting.substr(0, equals);
+        std::string value;
+        if (equals != std::string::npos)
+        {
+            value = setting.substr(equals + 1);
+        }
+
+        uint32_t number = 0;
+        bool isNumber = parseNumber(value, number);
+        bool known = true;
+
+        if (key == "type")
+        {
+            typeName = value;
+            isNumber = true;
+        }
+        else if (key == "mode")
+        {
+            if (value == "app") { appMode = true; }
+            else if (value == "bootloader") { appMode = false; }
+            else { known = false; }
+            isNumber = true;
+        }
+        else if (key == "count")
+        {
+            count = number;
+        }
+        else if (key == "enumerate")
+        {
+            timing.enumerateUs = number;
+        }
+        else if (key == "reconnect")
+        {
+            timing.reconnectMs = number;
+        }
+        else if (key == "transfer")
+        {
+            timing.defaultRequestUs = number;
+        }
+        else
+        {
+            known = false;
+            for (uint32_t request = 0; request < 256; request++)
+            {
+                const char * name = ploaderRequestName(request);
+                if (name && key == name)
+                {
+                    timing.requestUs[request] = number;
+                    known = true;
+                }
+            }
+        }
+
+        if (!known || !isNumber)
+        {
+            throw std::runtime_error(
+                "Invalid simulation setting '" + setting + "'.");
+        }
+    }
+
+    // Figure out which types of devices to simulate.
+    std::vector<PloaderType> types;
+    if (typeName == "all")
+    {
+        types = ploaderTypes;
+    }
+    else
+    {
+        const PloaderUserType * userType = ploaderUserTypeLookup(typeName);
+        if (userType == NULL)
+        {
+            throw std::runtime_error(
+                "Invalid device type '" + typeName + "'.");
+        }
+        types = userType->getMatchingTypes();
+    }
+
+    if (appMode)
+    {
+        // Only devices with apps can start out in app mode.
+        std::vector<PloaderType> typesWithApps;
+        for (const PloaderType & type : types)
+        {
+            if (!type.matchingAppTypes.empty())
+            {
+                typesWithApps.push_back(type);
+            }
+        }
+        types = typesWithApps;
+    }
+
+    if (types.empty())
+    {
+        throw std::runtime_error(
+            "There are no device types to simulate with those settings.");
+    }
+
+    std::shared_ptr<PloaderSimBus> bus = std::make_shared<PloaderSimBus>(timing);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        char serialNumber[16];
+        snprintf(serialNumber, sizeof(serialNumber), "SIM%05u", i + 1);
+        bus->addDevice(types[i % types.size()], serialNumber, appMode);
+    }
+    return bus;
+}
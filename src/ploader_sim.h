@@ -0,0 +1,96 @@
+#pragma once
+
+/* A software simulation of Pololu USB bootloaders and the apps that can start
+ * them.  It lets p-load run its normal code paths, including device listing,
+ * waiting for bootloaders, and all the bootloader requests, without any
+ * hardware connected.  Install it with ploaderSetBus. */
+
+#include "p-load.h"
+#include <atomic>
+#include <map>
+
+/* Latencies for the simulated devices. */
+class PloaderSimTiming
+{
+public:
+    PloaderSimTiming() : defaultRequestUs(0), enumerateUs(0), reconnectMs(0)
+    {
+    }
+
+    /* The time each control transfer takes, in microseconds, by request code.
+     * Requests that are not in the map take defaultRequestUs. */
+    std::map<uint8_t, uint32_t> requestUs;
+    uint32_t defaultRequestUs;
+
+    /* The time it takes to list the devices, in microseconds. */
+    uint32_t enumerateUs;
+
+    /* The time it takes for a device to reappear after it switches between
+     * app and bootloader mode, in milliseconds. */
+    uint32_t reconnectMs;
+
+    uint32_t getRequestUs(uint8_t request) const;
+};
+
+/* Counts of the requests that simulated devices have received. */
+class PloaderSimCounters
+{
+public:
+    PloaderSimCounters();
+
+    std::atomic<uint32_t> requests[256];
+
+    // The number of data bytes transferred in either direction.
+    std::atomic<uint64_t> bytes;
+};
+
+class PloaderSimDevice;
+
+/* A bus of simulated devices.  The devices run the bootloader protocol with
+ * the memory sizes and capabilities described by their PloaderType. */
+class PloaderSimBus : public PloaderBus
+{
+public:
+    explicit PloaderSimBus(PloaderSimTiming timing = PloaderSimTiming());
+
+    /* Adds a device.  If appMode is true, the device starts out running an
+     * app (which requires the type to have a matching app type).  Otherwise it
+     * starts out in bootloader mode with blank memory. */
+    void addDevice(const PloaderType & type, std::string serialNumber,
+        bool appMode);
+
+    DeviceSnapshot listDevices() override;
+
+    /* Returns the number of requests with the specified code that the devices
+     * on this bus have received. */
+    uint32_t getRequestCount(uint8_t request) const;
+
+    /* Returns the number of data bytes transferred to or from the devices on
+     * this bus. */
+    uint64_t getByteCount() const;
+
+    /* Creates a bus from a comma-separated list of settings, as given on the
+     * command line:
+     *
+     *   type=CODENAME     Device type, as for -t, or "all" (the default).
+     *   count=N           Number of devices (default 1).  The devices cycle
+     *                     through the bootloader types of the device type.
+     *   mode=app          Devices start in app mode instead of bootloader mode.
+     *   enumerate=US      Time to list devices.
+     *   reconnect=MS      Time for a device to switch between app and
+     *                     bootloader mode.
+     *   transfer=US       Default time for each control transfer.
+     *   REQUEST=US        Time for a specific request, where REQUEST is a
+     *                     name from ploaderRequestName: initialize, erase,
+     *                     write-flash, last-error, check-app, read-flash,
+     *                     device-code, read-eeprom, write-eeprom, restart,
+     *                     or start-bootloader.
+     *
+     * Throws an exception if the settings are invalid. */
+    static std::shared_ptr<PloaderSimBus> create(std::string settings);
+
+private:
+    PloaderSimTiming timing;
+    std::shared_ptr<PloaderSimCounters> counters;
+    std::vector<std::shared_ptr<PloaderSimDevice>> devices;
+};
@@ -0,0 +1,478 @@
+#include "session.h"
+
+void PloadSession::Listener::setStatus(const char * status,
+    uint32_t progress, uint32_t maxProgress)
+{
+    if (callback)
+    {
+        callback(status, progress, maxProgress);
+    }
+}
+
+void PloadSession::setProgressCallback(ProgressCallback callback)
+{
+    listener.callback = callback;
+}
+
+void PloadSession::setWriteOptions(const PloadWriteOptions & options)
+{
+    writeOptions = options;
+}
+
+void PloadSession::open(const std::string & serialNumber, uint32_t timeoutMs)
+{
+    handle.close();
+
+    DeviceSelector selector;
+    if (!serialNumber.empty())
+    {
+        selector.specifySerialNumber(serialNumber);
+    }
+
+    PloaderAppInstance app = selector.selectAppToLaunchBootloader();
+    if (app)
+    {
+        app.launchBootloader();
+        listener.setStatus("Waiting for bootloader...", 0, 0);
+
+        // Only wait for the bootloader of the device we just launched, even
+        // if no serial number was specified.
+        DeviceSelector bootloaderSelector;
+        bootloaderSelector.specifySerialNumber(app.serialNumber);
+        DeviceWaitLoop waitLoop(bootloaderSelector, timeoutMs);
+        bool found = waitLoop.waitUntil([&]()
+        {
+            return bootloaderSelector.listBootloaders().size() > 0;
+        });
+        if (!found)
+        {
+            throw ExceptionWithExitCode(PLOAD_ERROR_DEVICE_NOT_FOUND,
+                "Bootloader did not appear.");
+        }
+        handle = PloaderHandle(bootloaderSelector.selectBootloader());
+    }
+    else
+    {
+        if (selector.listBootloaders().empty())
+        {
+            throw selector.deviceNotFoundError();
+        }
+        handle = PloaderHandle(selector.selectBootloader());
+    }
+    handle.setStatusListener(&listener);
+}
+
+void PloadSession::open(PloaderHandle newHandle)
+{
+    handle = newHandle;
+    handle.setStatusListener(&listener);
+}
+
+void PloadSession::loadFirmware(const char * buffer, size_t size,
+    const std::string & name)
+{
+    firmware = FirmwareData();
+    firmware.readFromBuffer(buffer, size, name.c_str());
+}
+
+void PloadSession::ensureCanWrite(const FirmwareData & data,
+    MemorySet memorySet) const
+{
+    const PloaderType & type = getType();
+    data.ensureBootloaderCompatibility(type, memorySet);
+
+    if (writeOptions.verify && !data.canCompareWithBootloader(type, memorySet))
+    {
+        throw std::runtime_error(
+            "The data written to this device cannot be read back for verification.");
+    }
+}
+
+void PloadSession::write(MemorySet memorySet)
+{
+    write(getFirmware(), memorySet);
+}
+
+void PloadSession::write(const FirmwareData & data, MemorySet memorySet)
+{
+    PloaderHandle & h = getHandle();
+    ensureCanWrite(data, memorySet);
+
+    if (writeOptions.writeIfDifferent &&
+        data.canCompareWithBootloader(h.type, memorySet) &&
+        data.compareWithBootloader(h, memorySet).empty())
+    {
+        h.reportStatus("The device already has this data.  Skipping write.");
+        return;
+    }
+
+    const std::string & ledgerFileName = writeOptions.ledgerFileName;
+    if (writeOptions.skipIfRecorded &&
+        FirmwareLedger(ledgerFileName).contains(h, data, memorySet))
+    {
+        h.reportStatus("The ledger shows the device has this data.  Skipping write.");
+        return;
+    }
+
+    // Forget what was there before touching the device, so that a write
+    // that fails partway is not mistaken for the old data later.
+    if (!ledgerFileName.empty())
+    {
+        FirmwareLedger(ledgerFileName).forget(h, memorySet);
+    }
+
+    data.writeToBootloader(h, memorySet);
+
+    if (writeOptions.verify)
+    {
+        data.verifyWithBootloader(h, memorySet);
+    }
+
+    if (!ledgerFileName.empty())
+    {
+        FirmwareLedger(ledgerFileName).record(h, data, memorySet);
+    }
+}
+
+void PloadSession::erase(MemorySet memorySet)
+{
+    PloaderHandle & h = getHandle();
+    h.type.ensureErasing(memorySet);
+
+    if (!writeOptions.ledgerFileName.empty())
+    {
+        FirmwareLedger(writeOptions.ledgerFileName).forget(h, memorySet);
+    }
+
+    if (h.type.memorySetIncludesFlash(memorySet))
+    {
+        h.initialize();
+        h.eraseFlash();
+    }
+
+    if (h.type.memorySetIncludesEeprom(memorySet))
+    {
+        h.eraseEeprom();
+    }
+}
+
+void PloadSession::patchEeprom(const SparseImage & patch)
+{
+    PloaderHandle & h = getHandle();
+
+    // The bootloader's EEPROM addresses start at eepromAddress.
+    SparseImage bootloaderPatch;
+    for (const auto & interval : patch.getIntervals())
+    {
+        bootloaderPatch.write(h.type.eepromAddress + interval.first,
+            &interval.second[0], interval.second.size());
+    }
+
+    h.type.ensureEepromAccess();
+
+    if (!writeOptions.ledgerFileName.empty())
+    {
+        FirmwareLedger(writeOptions.ledgerFileName).forget(h, MEMORY_SET_EEPROM);
+    }
+
+    h.patchEeprom(bootloaderPatch);
+}
+
+/* Passes status on to another listener, scaling the progress of each step of
+ * a fused write so that the whole write is reported as one task. */
+class FusedStatusListener : public PloaderStatusListener
+{
+public:
+    FusedStatusListener(PloaderStatusListener * listener, uint32_t total)
+        : listener(listener), total(total), done(0), stepSize(0)
+    {
+    }
+
+    // Starts the next step, which accounts for the specified part of the
+    // total.
+    void startStep(uint32_t size)
+    {
+        done += stepSize;
+        stepSize = size;
+    }
+
+    void setStatus(const char * status, uint32_t progress,
+        uint32_t maxProgress) override
+    {
+        if (maxProgress == 0)
+        {
+            listener->setStatus(status, 0, 0);
+            return;
+        }
+        uint32_t scaled = done + (uint64_t)progress * stepSize / maxProgress;
+        listener->setStatus(status, scaled, total);
+    }
+
+private:
+    PloaderStatusListener * listener;
+    uint32_t total;
+    uint32_t done;
+    uint32_t stepSize;
+};
+
+typedef std::pair<const FirmwareData *, MemorySet> WriteCheck;
+
+// Returns the data that the plan writes, along with the memories it is
+// written to.
+static std::vector<WriteCheck> getChecks(const WritePlan & plan)
+{
+    std::vector<WriteCheck> checks;
+    if (plan.flashData && plan.flashData == plan.eepromData)
+    {
+        checks.push_back(WriteCheck(plan.flashData, MEMORY_SET_ALL));
+        return checks;
+    }
+    if (plan.eepromData)
+    {
+        checks.push_back(WriteCheck(plan.eepromData, MEMORY_SET_EEPROM));
+    }
+    if (plan.flashData)
+    {
+        checks.push_back(WriteCheck(plan.flashData, MEMORY_SET_FLASH));
+    }
+    return checks;
+}
+
+// Returns true if the device already has all the data that the plan
+// writes.  A plan that erases a memory is never skipped, just like
+// --erase on its own.
+static bool deviceMatches(PloaderHandle & handle, const WritePlan & plan)
+{
+    if ((plan.flashTouched && !plan.flashData) ||
+        (plan.eepromTouched && !plan.eepromData))
+    {
+        return false;
+    }
+
+    for (const WriteCheck & check : getChecks(plan))
+    {
+        if (!check.first->canCompareWithBootloader(handle.type, check.second) ||
+            !check.first->compareWithBootloader(handle, check.second).empty())
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Like deviceMatches, but asks the ledger instead of the device.
+static bool ledgerContains(const FirmwareLedger & ledger,
+    const PloaderHandle & handle, const WritePlan & plan)
+{
+    if ((plan.flashTouched && !plan.flashData) ||
+        (plan.eepromTouched && !plan.eepromData))
+    {
+        return false;
+    }
+
+    for (const WriteCheck & check : getChecks(plan))
+    {
+        if (!ledger.contains(handle, *check.first, check.second))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Removes the ledger's records of the memories that the plan touches.  This
+// happens before the first request that changes the device, so a plan that
+// fails partway leaves no record of the old data behind.
+static void forgetTouched(const FirmwareLedger & ledger,
+    const PloaderHandle & handle, const WritePlan & plan)
+{
+    if (plan.flashTouched)
+    {
+        ledger.forget(handle, MEMORY_SET_FLASH);
+    }
+    else if (plan.eepromTouched)
+    {
+        ledger.forget(handle, MEMORY_SET_EEPROM);
+    }
+}
+
+// Records the data that the plan wrote.  Recording flash data removes the
+// records of the EEPROM, because erasing flash can change it, so the flash
+// record goes in before the EEPROM record.
+static void recordInLedger(const FirmwareLedger & ledger,
+    const PloaderHandle & handle, const WritePlan & plan)
+{
+    std::vector<WriteCheck> checks = getChecks(plan);
+    for (auto it = checks.rbegin(); it != checks.rend(); it++)
+    {
+        ledger.record(handle, *it->first, it->second);
+    }
+}
+
+// Estimates of the number of requests in each step of the plan, used to
+// divide up the progress.  The number of pages that the bootloader erases is
+// not known in advance, so we assume 1 KB pages.
+static uint32_t eraseStepSize(const PloaderType & type, const WritePlan & plan)
+{
+    return plan.flashTouched ? std::max<uint32_t>(1, type.appSize / 1024) : 0;
+}
+
+static uint32_t eepromStepSize(const PloaderType & type, const WritePlan & plan)
+{
+    return plan.eepromTouched ? type.eepromSize / PloaderHandle::eepromBlockSize : 0;
+}
+
+static uint32_t flashStepSize(const PloaderType & type, const WritePlan & plan)
+{
+    if (!plan.flashData) { return 0; }
+    return plan.flashData->hexData.getSparseImage().nonBlankBlocks(
+        type.appAddress, type.appSize, type.writeBlockSize).size();
+}
+
+static uint32_t planSize(const PloaderType & type, const WritePlan & plan)
+{
+    return eraseStepSize(type, plan) + eepromStepSize(type, plan) +
+        flashStepSize(type, plan);
+}
+
+static void executePlan(PloaderHandle & handle, const WritePlan & plan,
+    FusedStatusListener & listener)
+{
+    const PloaderType & type = handle.type;
+
+    if (plan.flashTouched)
+    {
+        if (plan.flashData)
+        {
+            handle.initialize(UPLOAD_TYPE_PLAIN);
+        }
+        else
+        {
+            handle.initialize();
+        }
+        listener.startStep(eraseStepSize(type, plan));
+        handle.eraseFlash();
+    }
+
+    if (plan.eepromTouched)
+    {
+        listener.startStep(eepromStepSize(type, plan));
+        if (plan.eepromData)
+        {
+            MemoryImage eeprom = plan.eepromData->hexData.getImage(
+                type.eepromAddressHexFile, type.eepromSize);
+            handle.writeEepromChanges(&eeprom[0]);
+        }
+        else
+        {
+            handle.eraseEeprom();
+        }
+    }
+
+    if (plan.flashData)
+    {
+        listener.startStep(flashStepSize(type, plan));
+        handle.writeFlash(plan.flashData->hexData.getSparseImage());
+    }
+}
+
+void PloadSession::writePlan(const WritePlan & plan)
+{
+    PloaderHandle & h = getHandle();
+
+    if (writeOptions.writeIfDifferent && deviceMatches(h, plan))
+    {
+        h.reportStatus("The device already has this data.  Skipping write.");
+        return;
+    }
+
+    FirmwareLedger ledger(writeOptions.ledgerFileName);
+    bool useLedger = !writeOptions.ledgerFileName.empty();
+
+    if (writeOptions.skipIfRecorded && ledgerContains(ledger, h, plan))
+    {
+        h.reportStatus("The ledger shows the device has this data.  Skipping write.");
+        return;
+    }
+
+    if (useLedger)
+    {
+        forgetTouched(ledger, h, plan);
+    }
+
+    FusedStatusListener fusedListener(&listener, planSize(h.type, plan));
+    h.setStatusListener(&fusedListener);
+    try
+    {
+        executePlan(h, plan, fusedListener);
+    }
+    catch(...)
+    {
+        h.setStatusListener(&listener);
+        throw;
+    }
+    h.setStatusListener(&listener);
+
+    if (writeOptions.verify)
+    {
+        for (const WriteCheck & check : getChecks(plan))
+        {
+            check.first->verifyWithBootloader(h, check.second);
+        }
+    }
+
+    if (useLedger)
+    {
+        recordInLedger(ledger, h, plan);
+    }
+}
+
+void PloadSession::verify(MemorySet memorySet)
+{
+    const FirmwareData & data = getFirmware();
+    PloaderHandle & h = getHandle();
+    if (!data.canCompareWithBootloader(h.type, memorySet))
+    {
+        throw std::runtime_error(
+            "The data written to this device cannot be read back for verification.");
+    }
+    data.verifyWithBootloader(h, memorySet);
+}
+
+void PloadSession::restart()
+{
+    getHandle().restartDevice();
+    handle.close();
+}
+
+const PloaderType & PloadSession::getType() const
+{
+    return getHandle().type;
+}
+
+PloaderHandle & PloadSession::getHandle()
+{
+    if (!handle)
+    {
+        throw std::runtime_error("No device is open.");
+    }
+    return handle;
+}
+
+const PloaderHandle & PloadSession::getHandle() const
+{
+    if (!handle)
+    {
+        throw std::runtime_error("No device is open.");
+    }
+    return handle;
+}
+
+const FirmwareData & PloadSession::getFirmware() const
+{
+    if (!firmware)
+    {
+        throw std::runtime_error("No firmware is loaded.");
+    }
+    return firmware;
+}
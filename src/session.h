@@ -0,0 +1,154 @@
+#pragma once
+
+/* PloadSession is the part of p-load that writes to one device.  Programs
+ * that use libp-load instead of running the p-load executable use it
+ * directly, and the command-line interface in p-load.cpp and the station
+ * daemon use it for every device they work on, so all three write, erase,
+ * verify, and keep the ledger the same way.
+ *
+ * A session keeps all of its state in the object, so a program can use
+ * several sessions at once from different threads (each session should only
+ * be used by one thread at a time).  The bus that devices are listed from
+ * (ploaderSetBus), tracing, and transfer stats are settings of the whole
+ * process, which should be chosen before any sessions are opened.
+ * libp-load.h wraps it in a C API. */
+
+#include "p-load.h"
+
+#include <functional>
+
+/* Options that change how a session writes firmware.  Each one matches the
+ * p-load option of the same name. */
+class PloadWriteOptions
+{
+public:
+    PloadWriteOptions()
+        : verify(false), writeIfDifferent(false), skipIfRecorded(false)
+    {
+    }
+
+    // Reads back and checks the data after writing it (--verify).
+    bool verify;
+
+    // Skips writes if the device already has the data (--write-if-different).
+    bool writeIfDifferent;
+
+    // The ledger that records what gets written, or empty (--ledger).
+    std::string ledgerFileName;
+
+    // Skips writes that the ledger shows were done (--skip-if-recorded).
+    bool skipIfRecorded;
+};
+
+/* The combined effect of several writes and erases on the memories of one
+ * device.  For each memory that is touched, the data is what the last write
+ * or erase to touch it would leave there, or NULL if that one erases it. */
+class WritePlan
+{
+public:
+    WritePlan()
+        : flashTouched(false), flashData(NULL),
+          eepromTouched(false), eepromData(NULL)
+    {
+    }
+
+    bool flashTouched;
+    const FirmwareData * flashData;
+    bool eepromTouched;
+    const FirmwareData * eepromData;
+};
+
+class PloadSession
+{
+public:
+    typedef std::function<void(const char * status,
+        uint32_t progress, uint32_t maxProgress)> ProgressCallback;
+
+    PloadSession() { }
+
+    /* Sets a function that gets called with the status and progress of the
+     * operations, like the progress bar of p-load.  It is called on the
+     * thread that is using the session. */
+    void setProgressCallback(ProgressCallback callback);
+
+    void setWriteOptions(const PloadWriteOptions & options);
+
+    const PloadWriteOptions & getWriteOptions() const
+    {
+        return writeOptions;
+    }
+
+    /* Opens the bootloader of the device with the specified serial number.
+     * If the device is running an app, this starts its bootloader and waits
+     * up to timeoutMs milliseconds for it to appear. */
+    void open(const std::string & serialNumber, uint32_t timeoutMs = 10000);
+
+    /* Uses a bootloader that the caller found and opened some other way.  The
+     * session's progress callback replaces the handle's status listener. */
+    void open(PloaderHandle handle);
+
+    /* Loads firmware from a HEX or FMI file that is in memory, replacing any
+     * firmware loaded before.  The name is only used in error messages. */
+    void loadFirmware(const char * buffer, size_t size,
+        const std::string & name = "firmware");
+
+    /* Raises an exception if the data cannot be written to the specified
+     * memories of the open bootloader with the current options. */
+    void ensureCanWrite(const FirmwareData & data, MemorySet memorySet) const;
+
+    /* Writes the loaded firmware to the device. */
+    void write(MemorySet memorySet = MEMORY_SET_ALL);
+
+    /* Writes the data to the specified memories of the device, following the
+     * write options. */
+    void write(const FirmwareData & data, MemorySet memorySet);
+
+    /* Erases the specified memories of the device. */
+    void erase(MemorySet memorySet);
+
+    /* Changes some bytes of the device's EEPROM and leaves the others alone.
+     * The patch is keyed by EEPROM offset (0 is the first byte of EEPROM). */
+    void patchEeprom(const SparseImage & patch);
+
+    /* Gets the memories of the device to the state described by the plan with
+     * at most one initialization, one flash erase, and one write of each
+     * memory (EEPROM before flash, like FirmwareData::writeToBootloader).
+     * The plan must only contain HEX data. */
+    void writePlan(const WritePlan & plan);
+
+    /* Reads back the device's memories and throws an ExceptionWithExitCode
+     * if they do not match the loaded firmware. */
+    void verify(MemorySet memorySet = MEMORY_SET_ALL);
+
+    /* Restarts the device so it can run the new firmware.  The session is
+     * closed afterwards. */
+    void restart();
+
+    /* The type of the open bootloader. */
+    const PloaderType & getType() const;
+
+    /* The open bootloader, for operations the session does not wrap, like
+     * reading the memories. */
+    PloaderHandle & getHandle();
+    const PloaderHandle & getHandle() const;
+
+private:
+    PloadSession(const PloadSession &);
+    PloadSession & operator=(const PloadSession &);
+
+    const FirmwareData & getFirmware() const;
+
+    class Listener : public PloaderStatusListener
+    {
+    public:
+        void setStatus(const char * status, uint32_t progress,
+            uint32_t maxProgress) override;
+
+        ProgressCallback callback;
+    };
+
+    Listener listener;
+    PloadWriteOptions writeOptions;
+    PloaderHandle handle;
+    FirmwareData firmware;
+};
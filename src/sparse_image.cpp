@@ -0,0 +1,175 @@
+#include "sparse_image.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+static uint64_t intervalEnd(const SparseImage::IntervalMap::const_iterator & it)
+{
+    return (uint64_t)it->first + it->second.size();
+}
+
+// Returns the first interval that might contain the address or come after it.
+static SparseImage::IntervalMap::const_iterator firstIntervalAtOrAfter(
+    const SparseImage::IntervalMap & intervals, uint32_t address)
+{
+    auto it = intervals.upper_bound(address);
+    if (it != intervals.begin())
+    {
+        auto previous = std::prev(it);
+        if (intervalEnd(previous) > address)
+        {
+            return previous;
+        }
+    }
+    return it;
+}
+
+static std::runtime_error conflictError(uint32_t address)
+{
+    std::ostringstream message;
+    message << std::hex << std::uppercase << std::setfill('0');
+    message << "Conflicting data for address 0x" << std::setw(4) << address << ".";
+    return std::runtime_error(message.str());
+}
+
+void SparseImage::write(uint32_t address, const uint8_t * data, size_t size)
+{
+    if (size == 0) { return; }
+
+    const uint64_t end = (uint64_t)address + size;
+    if (end > 0x100000000)
+    {
+        throw std::runtime_error("Data goes past the end of the address space.");
+    }
+
+    // Find all the intervals that overlap or touch the new data, and make
+    // sure the overlapping parts have the same contents.
+    auto first = intervals.upper_bound(address);
+    if (first != intervals.begin() && intervalEnd(std::prev(first)) >= address)
+    {
+        first--;
+    }
+
+    auto last = first;
+    while (last != intervals.end() && last->first <= end)
+    {
+        uint64_t overlapStart = std::max<uint64_t>(last->first, address);
+        uint64_t overlapEnd = std::min<uint64_t>(intervalEnd(last), end);
+        for (uint64_t a = overlapStart; a < overlapEnd; a++)
+        {
+            if (last->second[a - last->first] != data[a - address])
+            {
+                throw conflictError(a);
+            }
+        }
+        last++;
+    }
+
+    if (first == last)
+    {
+        // The data does not touch any existing interval.
+        intervals[address].assign(data, data + size);
+        return;
+    }
+
+    if (std::next(first) == last && first->first <= address)
+    {
+        // This is the common case where the new data extends one interval
+        // (or is already entirely contained in it).
+        std::vector<uint8_t> & existing = first->second;
+        uint64_t existingEnd = intervalEnd(first);
+        if (end > existingEnd)
+        {
+            existing.insert(existing.end(),
+                data + (existingEnd - address), data + size);
+        }
+        return;
+    }
+
+    // Merge the new data and all the intervals it touches into one interval.
+    uint32_t mergedStart = std::min(first->first, address);
+    uint64_t mergedEnd = std::max(intervalEnd(std::prev(last)), end);
+    std::vector<uint8_t> merged(mergedEnd - mergedStart);
+    memcpy(&merged[address - mergedStart], data, size);
+    for (auto it = first; it != last; it++)
+    {
+        memcpy(&merged[it->first - mergedStart], it->second.data(), it->second.size());
+    }
+    intervals.erase(first, last);
+    intervals[mergedStart] = std::move(merged);
+}
+
+void SparseImage::write(uint32_t address, std::vector<uint8_t> && data)
+{
+    auto next = intervals.lower_bound(address);
+    bool touchesNext = next != intervals.end() &&
+        next->first <= (uint64_t)address + data.size();
+    bool touchesPrevious = next != intervals.begin() &&
+        intervalEnd(std::prev(next)) >= address;
+
+    if (!touchesNext && !touchesPrevious && !data.empty())
+    {
+        // Take ownership of the data without copying it.
+        intervals[address] = std::move(data);
+        return;
+    }
+
+    write(address, data.data(), data.size());
+}
+
+void SparseImage::read(uint32_t address, size_t size, uint8_t * out) const
+{
+    memset(out, 0xFF, size);
+
+    const uint64_t end = (uint64_t)address + size;
+    for (auto it = firstIntervalAtOrAfter(intervals, address);
+         it != intervals.end() && it->first < end; it++)
+    {
+        uint64_t start = std::max<uint64_t>(it->first, address);
+        uint64_t stop = std::min<uint64_t>(intervalEnd(it), end);
+        memcpy(out + (start - address), &it->second[start - it->first], stop - start);
+    }
+}
+
+std::vector<uint8_t> SparseImage::read(uint32_t address, size_t size) const
+{
+    std::vector<uint8_t> image(size);
+    if (size) { read(address, size, &image[0]); }
+    return image;
+}
+
+std::vector<uint32_t> SparseImage::nonBlankBlocks(uint32_t address,
+    size_t size, uint32_t blockSize) const
+{
+    assert(blockSize > 0);
+
+    std::vector<uint32_t> blocks;
+    const uint64_t end = (uint64_t)address + size;
+
+    for (auto it = firstIntervalAtOrAfter(intervals, address);
+         it != intervals.end() && it->first < end; it++)
+    {
+        uint64_t start = std::max<uint64_t>(it->first, address);
+        uint64_t stop = std::min<uint64_t>(intervalEnd(it), end);
+
+        for (uint64_t a = start; a < stop; a++)
+        {
+            if (it->second[a - it->first] == 0xFF) { continue; }
+
+            uint32_t block = address + (a - address) / blockSize * blockSize;
+            if (blocks.empty() || blocks.back() != block)
+            {
+                blocks.push_back(block);
+            }
+
+            // Skip to the next block.
+            a = block + (uint64_t)blockSize - 1;
+        }
+    }
+
+    return blocks;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+/* A sparse image of a memory, stored as sorted address intervals that do not
+ * overlap or touch each other.  Contiguous writes are coalesced into a single
+ * interval.  Addresses that were never written read as 0xFF, which is what
+ * erased flash or EEPROM contains. */
+class SparseImage
+{
+public:
+    typedef std::map<uint32_t, std::vector<uint8_t>> IntervalMap;
+
+    /* Writes data to the image.  Throws an exception if the data overlaps
+     * data written earlier and has different contents there. */
+    void write(uint32_t address, const uint8_t * data, size_t size);
+
+    void write(uint32_t address, std::vector<uint8_t> && data);
+
+    /* Copies a range of the image into out, using 0xFF for the addresses that
+     * were never written.  This takes O(log n) time to find the first
+     * interval. */
+    void read(uint32_t address, size_t size, uint8_t * out) const;
+
+    std::vector<uint8_t> read(uint32_t address, size_t size) const;
+
+    /* Divides the specified range into blocks of the specified size, starting
+     * at the start of the range, and returns the addresses of the blocks that
+     * have any bytes that are not 0xFF, in ascending order.  Only the written
+     * intervals are examined, so blank regions cost nothing. */
+    std::vector<uint32_t> nonBlankBlocks(uint32_t address, size_t size,
+        uint32_t blockSize) const;
+
+    bool empty() const
+    {
+        return intervals.empty();
+    }
+
+    /* The intervals, keyed by their start address. */
+    const IntervalMap & getIntervals() const
+    {
+        return intervals;
+    }
+
+private:
+    IntervalMap intervals;
+};
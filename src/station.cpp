@@ -0,0 +1,934 @@
+/* The station daemon and its client.  See station.h. */
+
+#include "station.h"
+#include "session.h"
+
+#ifndef _WIN32
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+typedef std::vector<std::pair<std::string, std::string>> StationFields;
+
+static std::string escapeValue(const std::string & value)
+{
+    std::string r;
+    for (char c : value)
+    {
+        switch (c)
+        {
+        case '\\': r += "\\\\"; break;
+        case '\t': r += "\\t"; break;
+        case '\n': r += "\\n"; break;
+        default: r += c; break;
+        }
+    }
+    return r;
+}
+
+static std::string unescapeValue(const std::string & value)
+{
+    std::string r;
+    for (size_t i = 0; i < value.size(); i++)
+    {
+        if (value[i] != '\\' || i + 1 == value.size())
+        {
+            r += value[i];
+            continue;
+        }
+        i++;
+        switch (value[i])
+        {
+        case 't': r += '\t'; break;
+        case 'n': r += '\n'; break;
+        default: r += value[i]; break;
+        }
+    }
+    return r;
+}
+
+static std::string encodeFields(const StationFields & fields)
+{
+    std::string line;
+    for (const auto & field : fields)
+    {
+        if (!line.empty()) { line += '\t'; }
+        line += field.first + "=" + escapeValue(field.second);
+    }
+    return line;
+}
+
+static StationFields decodeFields(const std::string & line)
+{
+    StationFields fields;
+    size_t start = 0;
+    while (start <= line.size())
+    {
+        size_t end = line.find('\t', start);
+        if (end == std::string::npos) { end = line.size(); }
+        std::string field = line.substr(start, end - start);
+        size_t equals = field.find('=');
+        if (equals == std::string::npos)
+        {
+            throw std::runtime_error("Invalid field '" + field + "'.");
+        }
+        fields.push_back(std::make_pair(field.substr(0, equals),
+            unescapeValue(field.substr(equals + 1))));
+        start = end + 1;
+    }
+    return fields;
+}
+
+static const char * memorySetName(MemorySet memorySet)
+{
+    switch (memorySet)
+    {
+    case MEMORY_SET_FLASH: return "flash";
+    case MEMORY_SET_EEPROM: return "eeprom";
+    default: return "all";
+    }
+}
+
+std::string StationJob::encode() const
+{
+    StationFields fields;
+    if (!serialNumber.empty())
+    {
+        fields.push_back(std::make_pair("serial", serialNumber));
+    }
+    if (!typeName.empty())
+    {
+        fields.push_back(std::make_pair("type", typeName));
+    }
+    fields.push_back(std::make_pair("file", fileName));
+    fields.push_back(std::make_pair("memory", memorySetName(memorySet)));
+    if (restart)
+    {
+        fields.push_back(std::make_pair("restart", "1"));
+    }
+    return encodeFields(fields);
+}
+
+StationJob StationJob::decode(const std::string & line)
+{
+    StationJob job;
+    for (const auto & field : decodeFields(line))
+    {
+        const std::string & value = field.second;
+        if (field.first == "serial")
+        {
+            job.serialNumber = value;
+        }
+        else if (field.first == "type")
+        {
+            job.typeName = value;
+        }
+        else if (field.first == "file")
+        {
+            job.fileName = value;
+        }
+        else if (field.first == "memory")
+        {
+            if (value == "all") { job.memorySet = MEMORY_SET_ALL; }
+            else if (value == "flash") { job.memorySet = MEMORY_SET_FLASH; }
+            else if (value == "eeprom") { job.memorySet = MEMORY_SET_EEPROM; }
+            else
+            {
+                throw std::runtime_error("Invalid memory '" + value + "'.");
+            }
+        }
+        else if (field.first == "restart")
+        {
+            job.restart = value == "1";
+        }
+        else
+        {
+            throw std::runtime_error("Unknown job field '" + field.first + "'.");
+        }
+    }
+
+    if (job.fileName.empty())
+    {
+        throw std::runtime_error("The job does not specify a file.");
+    }
+
+    // The daemon and the client have different working directories, so a
+    // relative path could name a different file for each of them.
+    if (job.fileName[0] != '/')
+    {
+        throw std::runtime_error("The job file '" + job.fileName +
+            "' is not an absolute path.");
+    }
+    return job;
+}
+
+#ifndef _WIN32
+
+typedef std::chrono::steady_clock StationClock;
+
+// The number of parsed firmware files the daemon keeps.
+static const size_t stationFirmwareCacheSize = 8;
+
+static double msSince(StationClock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(
+        StationClock::now() - start).count();
+}
+
+static std::runtime_error socketError(const std::string & context)
+{
+    return std::runtime_error(context + ": " + strerror(errno) + ".");
+}
+
+static sockaddr_un socketAddress(const std::string & path)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path))
+    {
+        throw std::runtime_error(path + ": Invalid socket path.");
+    }
+    memcpy(address.sun_path, path.c_str(), path.size());
+    return address;
+}
+
+// Returns the canonical absolute path of an existing file.
+static std::string canonicalFileName(const std::string & fileName)
+{
+    char * path = realpath(fileName.c_str(), NULL);
+    if (path == NULL)
+    {
+        throw std::runtime_error(fileName + ": " + strerror(errno) + ".");
+    }
+    std::string result = path;
+    free(path);
+    return result;
+}
+
+namespace
+{
+    // Closes a socket when it goes out of scope.
+    class SocketCloser
+    {
+    public:
+        explicit SocketCloser(int fd) : fd(fd) { }
+        ~SocketCloser() { close(fd); }
+
+    private:
+        int fd;
+    };
+}
+
+static void sendLine(int fd, const std::string & line)
+{
+    std::string message = line + "\n";
+    size_t sent = 0;
+    while (sent < message.size())
+    {
+        ssize_t count = send(fd, message.data() + sent, message.size() - sent, 0);
+        if (count < 0 && errno == EINTR) { continue; }
+        if (count < 0)
+        {
+            throw socketError("Error sending to socket");
+        }
+        sent += count;
+    }
+}
+
+// Reads a line from the socket, without the newline.  Returns false if the
+// connection was closed before a whole line arrived.
+static bool receiveLine(int fd, std::string & line)
+{
+    // Jobs and results are short, so anything longer is a mistake.
+    const size_t maxLength = 0x10000;
+
+    line.clear();
+    while (line.size() < maxLength)
+    {
+        char c;
+        ssize_t count = recv(fd, &c, 1, 0);
+        if (count < 0 && errno == EINTR) { continue; }
+        if (count < 0)
+        {
+            throw socketError("Error receiving from socket");
+        }
+        if (count == 0) { return false; }
+        if (c == '\n') { return true; }
+        line += c;
+    }
+    throw std::runtime_error("The line received from the socket is too long.");
+}
+
+/* Keeps an up-to-date snapshot of the connected devices for all the jobs, so
+ * that they do not each have to enumerate the USB devices.  It enumerates
+ * again whenever a bootloader might have arrived, and at least twice a
+ * second.  After a job is done with a device, the device has probably
+ * restarted, so the job marks the snapshot as stale and the next job to ask
+ * for it enumerates right away. */
+class StationDeviceWatcher
+{
+public:
+    StationDeviceWatcher()
+        : snapshot(ploaderListDevices()), generation(1), stale(false),
+          stopping(false)
+    {
+        thread = std::thread(&StationDeviceWatcher::run, this);
+    }
+
+    ~StationDeviceWatcher()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        thread.join();
+    }
+
+    // Returns the latest snapshot, along with a number that goes up every
+    // time the snapshot is replaced.
+    DeviceSnapshot get(uint64_t & snapshotGeneration)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!stale)
+            {
+                snapshotGeneration = generation;
+                return snapshot;
+            }
+        }
+
+        DeviceSnapshot devices = ploaderListDevices();
+        snapshotGeneration = update(devices);
+        return devices;
+    }
+
+    void invalidate()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stale = true;
+    }
+
+    // Waits until there is a newer snapshot than the specified one, or until
+    // the deadline.
+    void waitForNewer(uint64_t snapshotGeneration,
+        StationClock::time_point deadline)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait_until(lock, deadline, [&]()
+        {
+            return generation != snapshotGeneration;
+        });
+    }
+
+private:
+    void run()
+    {
+        std::unique_ptr<DeviceEventSource> eventSource = deviceEventSourceCreate();
+        while (true)
+        {
+            eventSource->waitForArrival(500);
+
+            DeviceSnapshot devices;
+            try
+            {
+                devices = ploaderListDevices();
+            }
+            catch(const std::exception &)
+            {
+                // Keep the old snapshot and try again next time.
+                continue;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopping) { return; }
+            }
+            update(devices);
+        }
+    }
+
+    // Replaces the snapshot and returns its generation.
+    uint64_t update(const DeviceSnapshot & devices)
+    {
+        uint64_t newGeneration;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            snapshot = devices;
+            newGeneration = ++generation;
+            stale = false;
+        }
+        changed.notify_all();
+        return newGeneration;
+    }
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    DeviceSnapshot snapshot;
+    uint64_t generation;
+    bool stale;
+    bool stopping;
+    std::thread thread;
+};
+
+/* Keeps the firmware files that jobs have used, so each file only gets parsed
+ * again when it changes.  A cached file is used if its modification time, its
+ * size, and a hash of its contents all match.  Files are keyed by their
+ * canonical path, and only the most recently used ones are kept. */
+class StationFirmwareCache
+{
+public:
+    StationFirmwareCache() : useCount(0)
+    {
+    }
+
+    std::shared_ptr<const FirmwareData> get(const std::string & fileName,
+        bool & cached)
+    {
+        std::string path;
+        struct stat info;
+        try
+        {
+            path = canonicalFileName(fileName);
+            if (stat(path.c_str(), &info) != 0)
+            {
+                throw std::runtime_error(path + ": " + strerror(errno) + ".");
+            }
+        }
+        catch (const std::runtime_error &)
+        {
+            // The file is gone, so its entry is no use anymore.
+            std::lock_guard<std::mutex> lock(mutex);
+            entries.erase(path.empty() ? fileName : path);
+            throw;
+        }
+
+        FileContents contents(path);
+        uint64_t hash = hashBytes(contents.data(), contents.size());
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = entries.find(path);
+            if (it != entries.end() &&
+                it->second.modifiedTime == info.st_mtime &&
+                it->second.size == contents.size() &&
+                it->second.hash == hash)
+            {
+                it->second.lastUse = ++useCount;
+                cached = true;
+                return it->second.data;
+            }
+        }
+
+        // Parse without holding the lock, so jobs for other files do not have
+        // to wait.
+        std::shared_ptr<FirmwareData> data = std::make_shared<FirmwareData>();
+        data->readFromBuffer(contents.data(), contents.size(), fileName.c_str());
+
+        Entry entry;
+        entry.modifiedTime = info.st_mtime;
+        entry.size = contents.size();
+        entry.hash = hash;
+        entry.data = data;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        entry.lastUse = ++useCount;
+        entries[path] = entry;
+        evict();
+        cached = false;
+        return data;
+    }
+
+private:
+    class Entry
+    {
+    public:
+        time_t modifiedTime;
+        size_t size;
+        uint64_t hash;
+        uint64_t lastUse;
+        std::shared_ptr<const FirmwareData> data;
+    };
+
+    // Removes the least recently used entries until there are few enough.
+    // Must be called with the mutex locked.
+    void evict()
+    {
+        while (entries.size() > stationFirmwareCacheSize)
+        {
+            auto oldest = entries.begin();
+            for (auto it = entries.begin(); it != entries.end(); it++)
+            {
+                if (it->second.lastUse < oldest->second.lastUse) { oldest = it; }
+            }
+            entries.erase(oldest);
+        }
+    }
+
+    std::mutex mutex;
+    std::map<std::string, Entry> entries;
+    uint64_t useCount;
+};
+
+/* The serial numbers of the devices that jobs are working on, so that two
+ * jobs cannot use the same device at once. */
+class StationDeviceClaims
+{
+public:
+    void claim(const std::string & serialNumber)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!serialNumbers.insert(serialNumber).second)
+        {
+            throw std::runtime_error("The device with serial number '" +
+                serialNumber + "' is busy with another job.");
+        }
+    }
+
+    void release(const std::string & serialNumber)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        serialNumbers.erase(serialNumber);
+    }
+
+private:
+    std::mutex mutex;
+    std::set<std::string> serialNumbers;
+};
+
+namespace
+{
+    // Holds a claim on a device until it goes out of scope.  Since the job
+    // might have restarted the device, the device snapshot is stale after
+    // that.
+    class StationDeviceClaim
+    {
+    public:
+        StationDeviceClaim(StationDeviceClaims & claims,
+            StationDeviceWatcher & watcher, std::string serialNumber)
+            : claims(claims), watcher(watcher), serialNumber(serialNumber)
+        {
+            claims.claim(serialNumber);
+        }
+
+        ~StationDeviceClaim()
+        {
+            watcher.invalidate();
+            claims.release(serialNumber);
+        }
+
+    private:
+        StationDeviceClaims & claims;
+        StationDeviceWatcher & watcher;
+        std::string serialNumber;
+    };
+
+    class StationJobResult
+    {
+    public:
+        StationJobResult()
+            : exitCode(0), cached(false),
+              loadMs(0), waitMs(0), writeMs(0), totalMs(0)
+        {
+        }
+
+        uint8_t exitCode;
+        std::string message;
+        std::string serialNumber;
+        std::string deviceName;
+        bool cached;
+        double loadMs;
+        double waitMs;
+        double writeMs;
+        double totalMs;
+    };
+}
+
+static std::string formatMs(double ms)
+{
+    char text[32];
+    snprintf(text, sizeof(text), "%.1f", ms);
+    return text;
+}
+
+class StationDaemon
+{
+public:
+    explicit StationDaemon(uint32_t waitTimeoutMs)
+        : waitTimeoutMs(waitTimeoutMs)
+    {
+    }
+
+    ~StationDaemon()
+    {
+        for (Worker & worker : workers)
+        {
+            worker.thread.join();
+        }
+    }
+
+    // Accepts connections and runs each job on its own thread.
+    void serve(int listenFd)
+    {
+        while (true)
+        {
+            int fd = accept(listenFd, NULL, NULL);
+            if (fd < 0 && errno == EINTR) { continue; }
+            if (fd < 0)
+            {
+                throw socketError("Error accepting connection");
+            }
+
+            joinFinishedWorkers();
+
+            workers.emplace_back();
+            Worker & worker = workers.back();
+            worker.thread = std::thread([this, fd, &worker]()
+            {
+                handleConnection(fd);
+                worker.done = true;
+            });
+        }
+    }
+
+private:
+    class Worker
+    {
+    public:
+        Worker() : done(false) { }
+        std::thread thread;
+        std::atomic<bool> done;
+    };
+
+    void joinFinishedWorkers()
+    {
+        for (auto it = workers.begin(); it != workers.end(); )
+        {
+            if (it->done)
+            {
+                it->thread.join();
+                it = workers.erase(it);
+            }
+            else
+            {
+                it++;
+            }
+        }
+    }
+
+    void handleConnection(int fd)
+    {
+        SocketCloser closer(fd);
+        StationClock::time_point start = StationClock::now();
+        StationJob job;
+        StationJobResult result;
+
+        try
+        {
+            std::string line;
+            if (!receiveLine(fd, line)) { return; }
+
+            try
+            {
+                job = StationJob::decode(line);
+            }
+            catch(const std::runtime_error & error)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS, error.what());
+            }
+
+            runJob(job, result);
+        }
+        catch(const ExceptionWithExitCode & error)
+        {
+            result.exitCode = error.getCode();
+            result.message = error.what();
+        }
+        catch(const std::exception & error)
+        {
+            result.exitCode = PLOAD_ERROR_OPERATION_FAILED;
+            result.message = error.what();
+        }
+        result.totalMs = msSince(start);
+
+        printResult(job, result);
+
+        StationFields fields;
+        fields.push_back(std::make_pair("result", result.exitCode ? "error" : "ok"));
+        if (result.exitCode)
+        {
+            fields.push_back(std::make_pair("code", std::to_string(result.exitCode)));
+            fields.push_back(std::make_pair("message", result.message));
+        }
+        fields.push_back(std::make_pair("serial", result.serialNumber));
+        fields.push_back(std::make_pair("device", result.deviceName));
+        fields.push_back(std::make_pair("cached", result.cached ? "1" : "0"));
+        fields.push_back(std::make_pair("load_ms", formatMs(result.loadMs)));
+        fields.push_back(std::make_pair("wait_ms", formatMs(result.waitMs)));
+        fields.push_back(std::make_pair("write_ms", formatMs(result.writeMs)));
+        fields.push_back(std::make_pair("total_ms", formatMs(result.totalMs)));
+
+        try
+        {
+            sendLine(fd, encodeFields(fields));
+        }
+        catch(const std::exception &)
+        {
+            // The client is gone, but the job is done anyway.
+        }
+    }
+
+    void printResult(const StationJob & job, const StationJobResult & result)
+    {
+        std::string serialNumber = result.serialNumber;
+        if (serialNumber.empty()) { serialNumber = job.serialNumber; }
+        if (serialNumber.empty()) { serialNumber = "?"; }
+
+        std::lock_guard<std::mutex> lock(outputMutex);
+        std::cout << serialNumber << ": ";
+        if (result.exitCode)
+        {
+            std::cout << "Error: " << result.message;
+        }
+        else
+        {
+            std::cout << "OK";
+        }
+        std::cout << " (" << job.fileName
+                  << (result.cached ? ", cached" : "")
+                  << ", " << formatMs(result.totalMs) << " ms)" << std::endl;
+    }
+
+    // Refreshes the selector from the shared snapshot until check() returns
+    // true.  Returns false if the deadline passes first.
+    bool waitForDevices(DeviceSelector & selector,
+        StationClock::time_point deadline, std::function<bool()> check)
+    {
+        while (true)
+        {
+            uint64_t generation;
+            selector.useSnapshot(watcher.get(generation));
+            if (check()) { return true; }
+            if (StationClock::now() >= deadline) { return false; }
+            watcher.waitForNewer(generation, deadline);
+        }
+    }
+
+    void runJob(const StationJob & job, StationJobResult & result)
+    {
+        StationClock::time_point loadStart = StationClock::now();
+        std::shared_ptr<const FirmwareData> data =
+            firmwareCache.get(job.fileName, result.cached);
+        result.loadMs = msSince(loadStart);
+
+        StationClock::time_point waitStart = StationClock::now();
+        StationClock::time_point deadline = waitStart +
+            std::chrono::milliseconds(waitTimeoutMs);
+
+        // Select the device the same way p-load does on the command line.
+        DeviceSelector selector;
+        if (!job.serialNumber.empty())
+        {
+            selector.specifySerialNumber(job.serialNumber);
+        }
+        if (!job.typeName.empty())
+        {
+            const PloaderUserType * userType = ploaderUserTypeLookup(job.typeName);
+            if (userType == NULL)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+                    "Invalid device type '" + job.typeName + "'.");
+            }
+            selector.specifyUserType(*userType);
+        }
+        selector.specifyFirmwareData(*data);
+
+        bool found = waitForDevices(selector, deadline, [&]()
+        {
+            return !selector.listApps().empty() ||
+                !selector.listBootloaders().empty();
+        });
+        if (!found)
+        {
+            throw selector.deviceNotFoundError();
+        }
+
+        PloaderAppInstance app = selector.selectAppToLaunchBootloader();
+        PloaderInstance bootloader;
+        if (!app)
+        {
+            bootloader = selector.selectBootloader();
+        }
+        result.serialNumber = app ? app.serialNumber : bootloader.serialNumber;
+
+        StationDeviceClaim claim(claims, watcher, result.serialNumber);
+
+        if (app)
+        {
+            app.launchBootloader();
+
+            DeviceSelector bootloaderSelector;
+            bootloaderSelector.specifySerialNumber(app.serialNumber);
+            found = waitForDevices(bootloaderSelector, deadline, [&]()
+            {
+                return !bootloaderSelector.listBootloaders().empty();
+            });
+            if (!found)
+            {
+                throw ExceptionWithExitCode(PLOAD_ERROR_DEVICE_NOT_FOUND,
+                    "Bootloader did not appear.");
+            }
+            bootloader = bootloaderSelector.selectBootloader();
+        }
+        result.deviceName = bootloader.type.name;
+        result.waitMs = msSince(waitStart);
+
+        StationClock::time_point writeStart = StationClock::now();
+        PloadSession session;
+        session.open(PloaderHandle(bootloader));
+        session.write(*data, job.memorySet);
+        if (job.restart)
+        {
+            session.restart();
+        }
+        result.writeMs = msSince(writeStart);
+    }
+
+    uint32_t waitTimeoutMs;
+    StationDeviceWatcher watcher;
+    StationFirmwareCache firmwareCache;
+    StationDeviceClaims claims;
+    std::mutex outputMutex;
+    std::list<Worker> workers;
+};
+
+// Removes a socket file left behind by a daemon that is no longer running.
+static void removeStaleSocket(const std::string & socketPath,
+    const sockaddr_un & address)
+{
+    struct stat info;
+    if (stat(socketPath.c_str(), &info) != 0 || !S_ISSOCK(info.st_mode))
+    {
+        return;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        throw socketError(socketPath);
+    }
+    SocketCloser closer(fd);
+    if (connect(fd, (const sockaddr *)&address, sizeof(address)) == 0)
+    {
+        throw std::runtime_error(socketPath +
+            ": Another daemon is already listening on this socket.");
+    }
+    unlink(socketPath.c_str());
+}
+
+void stationRunDaemon(const std::string & socketPath, uint32_t waitTimeoutMs)
+{
+    // A client that disconnects early should not kill the daemon.
+    signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un address = socketAddress(socketPath);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        throw socketError(socketPath);
+    }
+    SocketCloser closer(fd);
+
+    removeStaleSocket(socketPath, address);
+
+    if (bind(fd, (const sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(fd, 16) != 0)
+    {
+        throw socketError(socketPath);
+    }
+
+    StationDaemon daemon(waitTimeoutMs);
+    std::cout << "Listening on " << socketPath << "." << std::endl;
+    daemon.serve(fd);
+}
+
+void stationSubmitJob(const std::string & socketPath, const StationJob & job)
+{
+    // The daemon cannot read our standard input, and it would resolve a
+    // relative path against its own working directory, so send it the
+    // absolute path of the file.
+    if (job.fileName == "-")
+    {
+        throw ExceptionWithExitCode(PLOAD_ERROR_BAD_ARGS,
+            "With --connect, the file cannot be standard input.");
+    }
+    StationJob resolvedJob = job;
+    resolvedJob.fileName = canonicalFileName(job.fileName);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un address = socketAddress(socketPath);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        throw socketError(socketPath);
+    }
+    SocketCloser closer(fd);
+
+    if (connect(fd, (const sockaddr *)&address, sizeof(address)) != 0)
+    {
+        throw socketError(socketPath);
+    }
+
+    sendLine(fd, resolvedJob.encode());
+
+    std::string line;
+    if (!receiveLine(fd, line))
+    {
+        throw std::runtime_error(
+            "The daemon closed the connection without sending a result.");
+    }
+
+    std::map<std::string, std::string> result;
+    for (const auto & field : decodeFields(line))
+    {
+        result[field.first] = field.second;
+    }
+
+    if (result["result"] != "ok")
+    {
+        uint8_t code = strtoul(result["code"].c_str(), NULL, 10);
+        if (code == 0) { code = PLOAD_ERROR_OPERATION_FAILED; }
+        throw ExceptionWithExitCode(code, result["message"]);
+    }
+
+    std::cout << result["serial"] << ": OK (" << result["device"] << ")"
+              << std::endl;
+    std::cout << "File:  " << (result["cached"] == "1" ? "cached" : "parsed")
+              << " in " << result["load_ms"] << " ms" << std::endl;
+    std::cout << "Wait:  " << result["wait_ms"] << " ms" << std::endl;
+    std::cout << "Write: " << result["write_ms"] << " ms" << std::endl;
+    std::cout << "Total: " << result["total_ms"] << " ms" << std::endl;
+}
+
+#else
+
+void stationRunDaemon(const std::string &, uint32_t)
+{
+    throw std::runtime_error("The station daemon is not supported on Windows.");
+}
+
+void stationSubmitJob(const std::string &, const StationJob &)
+{
+    throw std::runtime_error("The station daemon is not supported on Windows.");
+}
+
+#endif
@@ -0,0 +1,56 @@
+#pragma once
+
+/* Station mode, for production lines that program one board after another.
+ * "p-load --daemon SOCKET" starts a long-running process that listens on a
+ * Unix domain socket, keeps the firmware files it has parsed and an
+ * up-to-date list of the connected devices, and runs the jobs it receives on
+ * worker threads, so several boards can be programmed at once.
+ * "p-load --connect SOCKET" submits a job to it and prints the result.
+ *
+ * Each connection carries one job: the client sends a line of tab-separated
+ * KEY=VALUE fields describing the job, and the daemon answers with a line in
+ * the same format describing the result.  Backslashes, tabs, and newlines in
+ * the values are escaped as \\, \t, and \n.
+ *
+ * Station mode is not available on Windows. */
+
+#include "p-load.h"
+
+/* A request to write a firmware file to one device. */
+class StationJob
+{
+public:
+    StationJob() : memorySet(MEMORY_SET_ALL), restart(false)
+    {
+    }
+
+    // The serial number of the device, or empty to accept any device.
+    std::string serialNumber;
+
+    // A device type as accepted by -t, or empty to infer the type from the
+    // file like p-load normally does.
+    std::string typeName;
+
+    // The file to write.  The daemon opens it, so stationSubmitJob sends it
+    // as an absolute path, and the daemon rejects relative paths.
+    std::string fileName;
+
+    MemorySet memorySet;
+    bool restart;
+
+    /* Returns the job as a request line, without the newline. */
+    std::string encode() const;
+
+    /* Parses a request line.  Throws an exception if it is invalid. */
+    static StationJob decode(const std::string & line);
+};
+
+/* Listens for jobs on the specified socket until the process is killed.  The
+ * timeout applies to waiting for a device to appear.  Throws an exception if
+ * the socket cannot be set up. */
+void stationRunDaemon(const std::string & socketPath, uint32_t waitTimeoutMs);
+
+/* Sends a job to the daemon listening on the specified socket, waits for the
+ * result, and prints it.  Throws an ExceptionWithExitCode if the job failed,
+ * with the exit code that p-load would have used for the same error. */
+void stationSubmitJob(const std::string & socketPath, const StationJob & job);
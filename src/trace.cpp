@@ -0,0 +1,164 @@
+#include "trace.h"
+
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+std::atomic<bool> traceEnabled(false);
+
+namespace
+{
+    class TraceEvent
+    {
+    public:
+        std::string name;
+        std::string serialNumber;
+        std::string typeName;
+        uint32_t threadNumber;
+        uint64_t start;
+        uint64_t duration;
+    };
+}
+
+// The gang workers record spans from several threads, so this mutex protects
+// everything below.
+static std::mutex traceMutex;
+static std::vector<TraceEvent> traceEvents;
+static std::map<std::thread::id, uint32_t> traceThreadNumbers;
+
+// When tracing started, in steady_clock ticks.  traceNow reads this without
+// the mutex, so it is atomic.
+static std::atomic<std::chrono::steady_clock::rep> traceStartTicks(0);
+
+void traceStart()
+{
+    std::lock_guard<std::mutex> lock(traceMutex);
+    traceEvents.clear();
+    traceThreadNumbers.clear();
+    traceStartTicks = std::chrono::steady_clock::now().time_since_epoch().count();
+    traceEnabled = true;
+}
+
+void traceStop()
+{
+    std::lock_guard<std::mutex> lock(traceMutex);
+    traceEnabled = false;
+    traceEvents.clear();
+    traceThreadNumbers.clear();
+}
+
+uint64_t traceNow()
+{
+    std::chrono::steady_clock::duration start(traceStartTicks.load());
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch() - start).count();
+}
+
+void traceRecord(const char * name, const char * serialNumber,
+    const char * typeName, uint64_t start, uint64_t duration)
+{
+    std::lock_guard<std::mutex> lock(traceMutex);
+
+    // Number the threads in the order they first record a span, so the main
+    // thread is 1 and the gang workers follow it.
+    std::thread::id id = std::this_thread::get_id();
+    auto it = traceThreadNumbers.find(id);
+    if (it == traceThreadNumbers.end())
+    {
+        uint32_t number = traceThreadNumbers.size() + 1;
+        it = traceThreadNumbers.insert(std::make_pair(id, number)).first;
+    }
+
+    TraceEvent event;
+    event.name = name;
+    if (serialNumber) { event.serialNumber = serialNumber; }
+    if (typeName) { event.typeName = typeName; }
+    event.threadNumber = it->second;
+    event.start = start;
+    event.duration = duration;
+    traceEvents.push_back(event);
+}
+
+static std::string jsonString(const std::string & s)
+{
+    std::string r = "\"";
+    for (unsigned char c : s)
+    {
+        if (c == '"' || c == '\\')
+        {
+            r += '\\';
+            r += c;
+        }
+        else if (c < 0x20)
+        {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            r += escape;
+        }
+        else
+        {
+            r += c;
+        }
+    }
+    return r + "\"";
+}
+
+void traceWrite(std::ostream & stream)
+{
+    std::lock_guard<std::mutex> lock(traceMutex);
+
+    stream << "{\"traceEvents\":[";
+    bool first = true;
+    for (const TraceEvent & event : traceEvents)
+    {
+        stream << (first ? "\n" : ",\n");
+        first = false;
+        stream << "{\"name\":" << jsonString(event.name)
+            << ",\"cat\":\"p-load\",\"ph\":\"X\",\"pid\":1"
+            << ",\"tid\":" << event.threadNumber
+            << ",\"ts\":" << event.start
+            << ",\"dur\":" << event.duration
+            << ",\"args\":{";
+        if (!event.serialNumber.empty())
+        {
+            stream << "\"serial\":" << jsonString(event.serialNumber);
+        }
+        if (!event.typeName.empty())
+        {
+            if (!event.serialNumber.empty()) { stream << ","; }
+            stream << "\"type\":" << jsonString(event.typeName);
+        }
+        stream << "}}";
+    }
+    stream << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+std::string traceSummary()
+{
+    std::lock_guard<std::mutex> lock(traceMutex);
+
+    // Add up the time for each phase, keeping the phases in the order they
+    // first finished.
+    std::vector<std::string> names;
+    std::map<std::string, std::pair<uint32_t, uint64_t>> totals;
+    for (const TraceEvent & event : traceEvents)
+    {
+        auto & total = totals[event.name];
+        if (total.first == 0) { names.push_back(event.name); }
+        total.first++;
+        total.second += event.duration;
+    }
+
+    std::string summary = "Phases:";
+    for (const std::string & name : names)
+    {
+        char text[128];
+        snprintf(text, sizeof(text), " %s %ux %.1f ms%s", name.c_str(),
+            totals[name].first, totals[name].second / 1000.0,
+            &name == &names.back() ? "" : ",");
+        summary += text;
+    }
+    return summary;
+}
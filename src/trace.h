@@ -0,0 +1,71 @@
+#pragma once
+
+/* Timing spans for the phases of p-load's work (enumerating devices, waiting
+ * for bootloaders, erasing, writing, and so on), which --trace saves in the
+ * Chrome trace event format.  Tracing is off unless traceStart is called, and
+ * while it is off, a TraceSpan only costs a check of one flag. */
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+/* Tracing is a setting of the whole process.  The flag is atomic so that it
+ * can be turned on or off while other threads (gang workers, or the sessions
+ * of a program using libp-load) are recording spans. */
+extern std::atomic<bool> traceEnabled;
+
+/* Clears any recorded spans and starts recording. */
+void traceStart();
+
+/* Stops recording and clears the recorded spans. */
+void traceStop();
+
+/* Returns the number of microseconds since tracing started. */
+uint64_t traceNow();
+
+/* Records a span that has finished.  The serial number and type name can be
+ * NULL. */
+void traceRecord(const char * name, const char * serialNumber,
+    const char * typeName, uint64_t start, uint64_t duration);
+
+/* Writes the recorded spans as a Chrome trace event JSON document, which can
+ * be loaded in chrome://tracing or Perfetto. */
+void traceWrite(std::ostream & stream);
+
+/* Returns a line summarizing the total time spent in each phase. */
+std::string traceSummary();
+
+/* Records a span covering its own lifetime.  The strings passed to it must
+ * stay valid until it is destroyed. */
+class TraceSpan
+{
+public:
+    explicit TraceSpan(const char * name, const char * serialNumber = NULL,
+        const char * typeName = NULL)
+        : name(name), serialNumber(serialNumber), typeName(typeName),
+          active(traceEnabled), start(0)
+    {
+        if (active) { start = traceNow(); }
+    }
+
+    ~TraceSpan()
+    {
+        if (active)
+        {
+            traceRecord(name, serialNumber, typeName, start,
+                traceNow() - start);
+        }
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan & operator=(const TraceSpan &) = delete;
+
+private:
+    const char * name;
+    const char * serialNumber;
+    const char * typeName;
+    bool active;
+    uint64_t start;
+};
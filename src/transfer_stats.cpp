@@ -0,0 +1,150 @@
+#include "transfer_stats.h"
+#include "p-load.h"
+
+std::atomic<bool> transferStatsEnabled(false);
+
+// Latency bucket 0 holds transfers that took less than 2 microseconds, and
+// bucket N holds transfers that took from 2^N to 2^(N+1) - 1 microseconds.  The
+// last bucket also holds anything slower.
+static const uint32_t latencyBucketCount = 24;
+
+namespace
+{
+    class RequestStats
+    {
+    public:
+        uint32_t count;
+        uint32_t failed;
+        uint64_t bytes;
+        uint64_t totalUs;
+        uint64_t minUs;
+        uint64_t maxUs;
+        uint32_t latencyBuckets[latencyBucketCount];
+    };
+}
+
+// The gang workers send transfers from several threads, so this mutex protects
+// the stats.  It is only held for a few additions, which is nothing compared to
+// the time a USB transfer takes.
+static std::mutex statsMutex;
+static RequestStats requestStats[256];
+
+static void clearStats()
+{
+    memset(requestStats, 0, sizeof(requestStats));
+}
+
+void transferStatsStart()
+{
+    std::lock_guard<std::mutex> lock(statsMutex);
+    clearStats();
+    transferStatsEnabled = true;
+}
+
+void transferStatsStop()
+{
+    std::lock_guard<std::mutex> lock(statsMutex);
+    transferStatsEnabled = false;
+    clearStats();
+}
+
+static uint32_t latencyBucket(uint64_t latencyUs)
+{
+    uint32_t bucket = 0;
+    while (latencyUs >= 2 && bucket < latencyBucketCount - 1)
+    {
+        latencyUs >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+void transferStatsRecord(uint8_t request, uint32_t bytes,
+    uint64_t latencyUs, bool failed)
+{
+    std::lock_guard<std::mutex> lock(statsMutex);
+    RequestStats & stats = requestStats[request];
+    if (stats.count == 0 || latencyUs < stats.minUs) { stats.minUs = latencyUs; }
+    if (latencyUs > stats.maxUs) { stats.maxUs = latencyUs; }
+    stats.count++;
+    if (failed) { stats.failed++; }
+    stats.bytes += bytes;
+    stats.totalUs += latencyUs;
+    stats.latencyBuckets[latencyBucket(latencyUs)]++;
+}
+
+static std::string requestLabel(uint32_t request)
+{
+    const char * name = ploaderRequestName(request);
+    if (name) { return name; }
+    char label[16];
+    snprintf(label, sizeof(label), "0x%02X", request);
+    return label;
+}
+
+void transferStatsWrite(std::ostream & stream)
+{
+    std::lock_guard<std::mutex> lock(statsMutex);
+
+    char line[160];
+    stream << "Transfers:" << std::endl;
+    snprintf(line, sizeof(line), "  %-18s %8s %7s %11s %10s %8s %8s %8s",
+        "Request", "Count", "Failed", "Bytes", "Total ms", "Min us",
+        "Mean us", "Max us");
+    stream << line << std::endl;
+
+    RequestStats total = RequestStats();
+    for (uint32_t request = 0; request < 256; request++)
+    {
+        const RequestStats & stats = requestStats[request];
+        if (stats.count == 0) { continue; }
+        snprintf(line, sizeof(line),
+            "  %-18s %8u %7u %11llu %10.1f %8llu %8llu %8llu",
+            requestLabel(request).c_str(), stats.count, stats.failed,
+            (unsigned long long)stats.bytes, stats.totalUs / 1000.0,
+            (unsigned long long)stats.minUs,
+            (unsigned long long)(stats.totalUs / stats.count),
+            (unsigned long long)stats.maxUs);
+        stream << line << std::endl;
+        total.count += stats.count;
+        total.failed += stats.failed;
+        total.bytes += stats.bytes;
+        total.totalUs += stats.totalUs;
+    }
+    snprintf(line, sizeof(line), "  %-18s %8u %7u %11llu %10.1f",
+        "Total", total.count, total.failed,
+        (unsigned long long)total.bytes, total.totalUs / 1000.0);
+    stream << line << std::endl;
+
+    if (total.count == 0) { return; }
+
+    // Only print the buckets that have something in them, since most
+    // requests take about the same time every time.
+    stream << "Latency histograms (us):" << std::endl;
+    for (uint32_t request = 0; request < 256; request++)
+    {
+        const RequestStats & stats = requestStats[request];
+        if (stats.count == 0) { continue; }
+        snprintf(line, sizeof(line), "  %-18s", requestLabel(request).c_str());
+        stream << line;
+        for (uint32_t bucket = 0; bucket < latencyBucketCount; bucket++)
+        {
+            uint32_t count = stats.latencyBuckets[bucket];
+            if (count == 0) { continue; }
+            uint64_t low = bucket == 0 ? 0 : (uint64_t)1 << bucket;
+            if (bucket == latencyBucketCount - 1)
+            {
+                snprintf(line, sizeof(line), " %llu+: %u",
+                    (unsigned long long)low, count);
+            }
+            else
+            {
+                snprintf(line, sizeof(line), " %llu-%llu: %u",
+                    (unsigned long long)low,
+                    ((unsigned long long)2 << bucket) - 1, count);
+            }
+            stream << line;
+        }
+        stream << std::endl;
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+/* Counters and latency histograms for the control transfers p-load sends,
+ * kept separately for each request code, which --stats prints at exit.
+ * Recording is off unless transferStatsStart is called, and while it is off,
+ * ploader.cpp does not wrap its transports, so it costs nothing. */
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+
+/* Transfer stats are a setting of the whole process.  The flag is atomic so
+ * that it can be turned on or off while other threads are sending transfers,
+ * but only transports opened while it is on get recorded. */
+extern std::atomic<bool> transferStatsEnabled;
+
+/* Clears any recorded transfers and starts recording. */
+void transferStatsStart();
+
+/* Stops recording and clears the recorded transfers. */
+void transferStatsStop();
+
+/* Records a control transfer that has finished.  The number of bytes is the
+ * number of data bytes transferred in either direction.  This can be called
+ * from several threads at once. */
+void transferStatsRecord(uint8_t request, uint32_t bytes,
+    uint64_t latencyUs, bool failed);
+
+/* Prints a table of the recorded transfers and a latency histogram for each
+ * request code. */
+void transferStatsWrite(std::ostream & stream);
@@ -0,0 +1,53 @@
+#pragma once
+
+/* A few helpers for the tests, which are plain programs instead of using a
+ * test framework.  TEST_CHECK prints the checks that fail and lets the test
+ * keep going, and testExitCode tells ctest whether any of them failed. */
+
+#include "p-load.h"
+
+static uint32_t testFailureCount = 0;
+
+#define TEST_CHECK(condition) \
+    testCheck((condition), #condition, __FILE__, __LINE__)
+
+static inline void testCheck(bool passed, const char * condition,
+    const char * file, int line)
+{
+    if (passed) { return; }
+    std::cerr << file << ":" << line << ": check failed: "
+        << condition << std::endl;
+    testFailureCount++;
+}
+
+// Returns true if the function throws an exception of the specified type.
+template <typename Error, typename Function>
+static bool testThrows(Function function)
+{
+    try
+    {
+        function();
+    }
+    catch (const Error &)
+    {
+        return true;
+    }
+    catch (const std::exception & error)
+    {
+        std::cerr << "Unexpected exception: " << error.what() << std::endl;
+        return false;
+    }
+    return false;
+}
+
+static inline int testExitCode(const char * name)
+{
+    if (testFailureCount)
+    {
+        std::cerr << name << ": " << testFailureCount << " checks failed."
+            << std::endl;
+        return 1;
+    }
+    std::cout << name << ": all checks passed." << std::endl;
+    return 0;
+}
@@ -0,0 +1,157 @@
+/* Tests PloaderAsyncHandle on simulated bootloaders.
+ *
+ * More devices than the default executor has threads get written to at once.
+ * One of them is cancelled in the middle of erasing flash, while it is holding
+ * one of the threads.  The other devices must still finish and end up with the
+ * new data, the cancelled device's remaining operations must fail with
+ * PloaderCancelledError, and its flash must be partly erased: the pages before
+ * the cancel are blank and the rest still have the old data. */
+
+#include "test.h"
+#include "ploader_protocol.h"
+
+#include <chrono>
+#include <condition_variable>
+
+static const uint32_t deviceCount = 12;
+
+// Where the erase of the cancelled device stops to wait for the test.
+static const uint32_t cancelAtPage = 4;
+
+static const uint8_t oldByte = 0x00;
+static const uint8_t newByte = 0x55;
+static const uint8_t blankByte = 0xFF;
+
+/* Holds the erase of one device at a specific page until the test has
+ * cancelled it, so the cancel always lands in the middle of the erase. */
+class EraseGate : public PloaderStatusListener
+{
+public:
+    EraseGate() : reached(false), released(false) { }
+
+    void setStatus(const char * status, uint32_t progress, uint32_t) override
+    {
+        if (strcmp(status, "Erasing flash...") != 0) { return; }
+        if (progress != cancelAtPage) { return; }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        reached = true;
+        changed.notify_all();
+        changed.wait(lock, [this]() { return released; });
+    }
+
+    bool waitUntilReached()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        return changed.wait_for(lock, std::chrono::seconds(10),
+            [this]() { return reached; });
+    }
+
+    void release()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        released = true;
+        changed.notify_all();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable changed;
+    bool reached;
+    bool released;
+};
+
+class DeviceFutures
+{
+public:
+    std::future<void> initialize;
+    std::future<void> erase;
+    std::future<void> write;
+    std::future<MemoryImage> read;
+};
+
+int main()
+{
+    std::shared_ptr<PloaderSimBus> bus = PloaderSimBus::create(
+        "type=p-star-45k50,count=" + std::to_string(deviceCount) +
+        ",erase=1000,write-flash=100,read-flash=100");
+    ploaderSetBus(bus);
+
+    TEST_CHECK(ploaderAsyncExecutor().getThreadCount() == 8);
+    TEST_CHECK(deviceCount > ploaderAsyncExecutor().getThreadCount());
+
+    // Put the old data on every device first, the normal way.
+    std::vector<std::unique_ptr<PloaderAsyncHandle>> devices;
+    for (const PloaderInstance & instance : ploaderListDevices().bootloaders)
+    {
+        PloaderHandle handle(instance);
+        MemoryImage image(handle.type.appSize, oldByte);
+        handle.initialize();
+        handle.eraseFlash();
+        handle.writeFlash(&image[0]);
+        devices.emplace_back(new PloaderAsyncHandle(handle));
+    }
+    TEST_CHECK(devices.size() == deviceCount);
+    if (devices.size() != deviceCount) { return testExitCode("async"); }
+    uint32_t erasesBefore = bus->getRequestCount(REQUEST_ERASE_FLASH);
+    uint32_t erasesPerDevice = erasesBefore / deviceCount;
+    TEST_CHECK(erasesPerDevice > cancelAtPage + 1);
+
+    PloaderAsyncHandle & cancelled = *devices[0];
+    uint32_t appSize = cancelled.getType().appSize;
+    EraseGate gate;
+    cancelled.setStatusListener(&gate);
+
+    std::vector<DeviceFutures> futures(devices.size());
+    for (size_t i = 0; i < devices.size(); i++)
+    {
+        futures[i].initialize = devices[i]->initialize();
+        futures[i].erase = devices[i]->eraseFlash();
+        futures[i].write = devices[i]->writeFlash(MemoryImage(appSize, newByte));
+        futures[i].read = devices[i]->readFlash();
+    }
+
+    bool reached = gate.waitUntilReached();
+    TEST_CHECK(reached);
+    cancelled.cancel();
+
+    // The cancelled device is still holding a thread, but the other devices
+    // can finish on the remaining ones.
+    for (size_t i = 1; i < devices.size(); i++)
+    {
+        futures[i].initialize.get();
+        futures[i].erase.get();
+        futures[i].write.get();
+        MemoryImage image = futures[i].read.get();
+        TEST_CHECK(image == MemoryImage(appSize, newByte));
+    }
+
+    gate.release();
+
+    futures[0].initialize.get();
+    TEST_CHECK(testThrows<PloaderCancelledError>(
+        [&]() { futures[0].erase.get(); }));
+    TEST_CHECK(testThrows<PloaderCancelledError>(
+        [&]() { futures[0].write.get(); }));
+    TEST_CHECK(testThrows<PloaderCancelledError>(
+        [&]() { futures[0].read.get(); }));
+
+    // Operations requested after the cancel run normally, so read back what
+    // the cancelled erase left behind.
+    MemoryImage image = cancelled.readFlash().get();
+    TEST_CHECK(image.size() == appSize);
+    size_t blankCount = std::find_if(image.begin(), image.end(),
+        [](uint8_t b) { return b != blankByte; }) - image.begin();
+    TEST_CHECK(blankCount > 0);
+    TEST_CHECK(blankCount < appSize);
+    TEST_CHECK(std::all_of(image.begin() + blankCount, image.end(),
+        [](uint8_t b) { return b == oldByte; }));
+
+    // The cancelled erase stopped after the page that followed the gate.
+    TEST_CHECK(bus->getRequestCount(REQUEST_ERASE_FLASH) == erasesBefore +
+        (deviceCount - 1) * erasesPerDevice + cancelAtPage + 1);
+
+    devices.clear();
+    ploaderSetBus(NULL);
+    return testExitCode("async");
+}
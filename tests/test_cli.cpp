@@ -0,0 +1,266 @@
+/* Tests the command-line interface end to end.
+ *
+ * Runs p-load in-process through ploadMain, like bench_flash, against two
+ * simulated P-Star 45K50 bootloaders that keep their memories between runs.
+ * Each case checks the exit code and then reads the devices back, or counts
+ * the requests they got, to see that the options did what they say. */
+
+#include "test.h"
+#include "ploader_protocol.h"
+
+#include <fstream>
+
+static const char goldenFileName[] = "test_cli_golden.hex";
+static const char otherFileName[] = "test_cli_other.hex";
+static const char readFileName[] = "test_cli_read.hex";
+static const char ledgerFileName[] = "test_cli.ledger";
+
+static PloaderType type;
+static std::shared_ptr<PloaderSimBus> bus;
+static IntelHex::Data golden;
+
+static std::vector<uint8_t> patternData(size_t size, uint8_t seed)
+{
+    std::vector<uint8_t> data(size);
+    for (size_t i = 0; i < size; i++)
+    {
+        data[i] = (uint8_t)(i * 7 + seed);
+    }
+    return data;
+}
+
+static void writeHexFile(const char * fileName, const IntelHex::Data & data)
+{
+    std::ofstream file(fileName);
+    data.writeToFile(file);
+}
+
+static IntelHex::Data readHexFile(const char * fileName)
+{
+    IntelHex::Data data;
+    std::ifstream file(fileName);
+    if (file)
+    {
+        data.readFromFile(file, fileName);
+    }
+    return data;
+}
+
+static bool fileExists(const std::string & fileName)
+{
+    return std::ifstream(fileName).good();
+}
+
+// Runs p-load with the specified arguments and returns its exit code.  The
+// output is only printed if the exit code is not the expected one.
+static int runPload(std::vector<std::string> args, int expectedExitCode = 0)
+{
+    args.insert(args.begin(), "p-load");
+    std::vector<char *> argv;
+    for (std::string & arg : args)
+    {
+        argv.push_back(&arg[0]);
+    }
+
+    // Like the real argv, the list ends with a null pointer.
+    argv.push_back(NULL);
+
+    std::ostringstream output;
+    std::streambuf * coutBuffer = std::cout.rdbuf(output.rdbuf());
+    std::streambuf * cerrBuffer = std::cerr.rdbuf(output.rdbuf());
+    int exitCode = ploadMain(args.size(), &argv[0]);
+    std::cout.rdbuf(coutBuffer);
+    std::cerr.rdbuf(cerrBuffer);
+
+    if (exitCode != expectedExitCode)
+    {
+        std::cerr << "p-load";
+        for (size_t i = 1; i < args.size(); i++) { std::cerr << " " << args[i]; }
+        std::cerr << " exited with " << exitCode << ":" << std::endl
+            << output.str();
+    }
+    return exitCode;
+}
+
+// Formats an address or offset for arguments like FILE@START:LEN.
+static std::string hex(uint32_t value)
+{
+    char buffer[16];
+    snprintf(buffer, sizeof(buffer), "0x%X", value);
+    return buffer;
+}
+
+static std::vector<uint8_t> goldenFlash()
+{
+    return golden.getImage(type.appAddress, type.appSize);
+}
+
+static std::vector<uint8_t> goldenEeprom()
+{
+    return golden.getImage(type.eepromAddressHexFile, type.eepromSize);
+}
+
+// Reads everything from one device with --read.
+static IntelHex::Data readDevice(const char * serialNumber)
+{
+    remove(readFileName);
+    runPload({ "-d", serialNumber, "--read", readFileName });
+    return readHexFile(readFileName);
+}
+
+static void testWrite()
+{
+    TEST_CHECK(runPload({ "-d", "SIM00001", "--write", goldenFileName,
+        "--verify" }) == 0);
+
+    IntelHex::Data device = readDevice("SIM00001");
+    TEST_CHECK(device.getImage(type.appAddress, type.appSize) == goldenFlash());
+    TEST_CHECK(device.getImage(type.eepromAddressHexFile, type.eepromSize) ==
+        goldenEeprom());
+}
+
+// The second device is still blank, so it does not match until it is written.
+static void testAudit()
+{
+    remove("audit-SIM00001.hex");
+    remove("audit-SIM00002.hex");
+    TEST_CHECK(runPload({ "--audit", goldenFileName },
+        PLOAD_ERROR_VERIFICATION_FAILED) == PLOAD_ERROR_VERIFICATION_FAILED);
+    TEST_CHECK(!fileExists("audit-SIM00001.hex"));
+    TEST_CHECK(fileExists("audit-SIM00002.hex"));
+
+    // The saved memories are what the device really has.
+    IntelHex::Data saved = readHexFile("audit-SIM00002.hex");
+    TEST_CHECK(saved.getImage(type.appAddress, type.appSize) ==
+        std::vector<uint8_t>(type.appSize, 0xFF));
+    remove("audit-SIM00002.hex");
+
+    TEST_CHECK(runPload({ "-d", "SIM00002", "--write", goldenFileName }) == 0);
+    TEST_CHECK(runPload({ "--audit", goldenFileName }) == 0);
+    TEST_CHECK(!fileExists("audit-SIM00002.hex"));
+}
+
+static void testReadRange()
+{
+    uint32_t start = type.appAddress + 0x100;
+    remove(readFileName);
+    TEST_CHECK(runPload({ "-d", "SIM00001", "--read-flash",
+        std::string(readFileName) + "@" + hex(start) + ":16" }) == 0);
+    IntelHex::Data range = readHexFile(readFileName);
+    const SparseImage::IntervalMap & intervals =
+        range.getSparseImage().getIntervals();
+    TEST_CHECK(intervals.size() == 1);
+    TEST_CHECK(intervals.begin()->first == start);
+    TEST_CHECK(intervals.begin()->second ==
+        golden.getImage(start, 16));
+
+    // EEPROM ranges are offsets from the start of EEPROM.
+    remove(readFileName);
+    TEST_CHECK(runPload({ "-d", "SIM00001", "--read-eeprom",
+        std::string(readFileName) + "@0x10:4" }) == 0);
+    range = readHexFile(readFileName);
+    TEST_CHECK(range.getSparseImage().getIntervals().size() == 1);
+    TEST_CHECK(range.getImage(type.eepromAddressHexFile + 0x10, 4) ==
+        golden.getImage(type.eepromAddressHexFile + 0x10, 4));
+
+    // Ranges outside the memory are rejected once the type is known, and
+    // --read does not take a range at all.
+    TEST_CHECK(runPload({ "-d", "SIM00001", "--read-flash",
+        std::string(readFileName) + "@0x0:16" }, PLOAD_ERROR_OPERATION_FAILED)
+        == PLOAD_ERROR_OPERATION_FAILED);
+    TEST_CHECK(runPload({ "-d", "SIM00001", "--read",
+        std::string(readFileName) + "@" + hex(start) + ":16" },
+        PLOAD_ERROR_BAD_ARGS) == PLOAD_ERROR_BAD_ARGS);
+}
+
+static void testPatchEeprom()
+{
+    uint32_t flashWritesBefore = bus->getRequestCount(REQUEST_WRITE_FLASH_BLOCK);
+    TEST_CHECK(runPload({ "-d", "SIM00001", "--patch-eeprom", "0x10=0102FF",
+        "--patch-eeprom", "0x40=AA" }) == 0);
+    TEST_CHECK(bus->getRequestCount(REQUEST_WRITE_FLASH_BLOCK) ==
+        flashWritesBefore);
+
+    std::vector<uint8_t> expected = goldenEeprom();
+    expected[0x10] = 0x01;
+    expected[0x11] = 0x02;
+    expected[0x12] = 0xFF;
+    expected[0x40] = 0xAA;
+
+    IntelHex::Data device = readDevice("SIM00001");
+    TEST_CHECK(device.getImage(type.eepromAddressHexFile, type.eepromSize) ==
+        expected);
+    TEST_CHECK(device.getImage(type.appAddress, type.appSize) == goldenFlash());
+
+    // Patches outside of EEPROM are rejected before anything is written.
+    uint32_t eepromWritesBefore = bus->getRequestCount(REQUEST_WRITE_EEPROM);
+    TEST_CHECK(runPload({ "-d", "SIM00001", "--patch-eeprom",
+        hex(type.eepromSize) + "=00" }, PLOAD_ERROR_OPERATION_FAILED)
+        == PLOAD_ERROR_OPERATION_FAILED);
+    TEST_CHECK(bus->getRequestCount(REQUEST_WRITE_EEPROM) == eepromWritesBefore);
+    IntelHex::Data after = readDevice("SIM00001");
+    TEST_CHECK(after.getImage(type.eepromAddressHexFile, type.eepromSize) ==
+        expected);
+}
+
+static void testLedger()
+{
+    remove(ledgerFileName);
+
+    TEST_CHECK(runPload({ "-d", "SIM00001", "--write", goldenFileName,
+        "--ledger", ledgerFileName }) == 0);
+    TEST_CHECK(fileExists(ledgerFileName));
+
+    // The ledger shows that the device has the golden image, so nothing is
+    // written the second time.
+    uint32_t writesBefore = bus->getRequestCount(REQUEST_WRITE_FLASH_BLOCK);
+    TEST_CHECK(runPload({ "-d", "SIM00001", "--write", goldenFileName,
+        "--ledger", ledgerFileName, "--skip-if-recorded" }) == 0);
+    TEST_CHECK(bus->getRequestCount(REQUEST_WRITE_FLASH_BLOCK) == writesBefore);
+
+    // Other firmware is not in the ledger, so it gets written.
+    TEST_CHECK(runPload({ "-d", "SIM00001", "--write", otherFileName,
+        "--ledger", ledgerFileName, "--skip-if-recorded" }) == 0);
+    TEST_CHECK(bus->getRequestCount(REQUEST_WRITE_FLASH_BLOCK) > writesBefore);
+    IntelHex::Data device = readDevice("SIM00001");
+    TEST_CHECK(device.getImage(type.appAddress, type.appSize) ==
+        readHexFile(otherFileName).getImage(type.appAddress, type.appSize));
+
+    // The ledger now records the other firmware, so the golden image is not
+    // skipped anymore.
+    writesBefore = bus->getRequestCount(REQUEST_WRITE_FLASH_BLOCK);
+    TEST_CHECK(runPload({ "-d", "SIM00001", "--write", goldenFileName,
+        "--ledger", ledgerFileName, "--skip-if-recorded" }) == 0);
+    TEST_CHECK(bus->getRequestCount(REQUEST_WRITE_FLASH_BLOCK) > writesBefore);
+
+    remove(ledgerFileName);
+    remove((std::string(ledgerFileName) + ".lock").c_str());
+}
+
+int main()
+{
+    type = ploaderUserTypeLookup("p-star-45k50")->getMatchingTypes().at(0);
+
+    golden.setImage(type.appAddress, patternData(type.appSize, 1));
+    golden.setImage(type.eepromAddressHexFile, patternData(type.eepromSize, 2));
+    writeHexFile(goldenFileName, golden);
+
+    IntelHex::Data other;
+    other.setImage(type.appAddress, patternData(type.appSize, 3));
+    writeHexFile(otherFileName, other);
+
+    bus = PloaderSimBus::create("type=p-star-45k50,count=2");
+    ploaderSetBus(bus);
+
+    testWrite();
+    testAudit();
+    testReadRange();
+    testPatchEeprom();
+    testLedger();
+
+    ploaderSetBus(NULL);
+    remove(goldenFileName);
+    remove(otherFileName);
+    remove(readFileName);
+    return testExitCode("cli");
+}
@@ -0,0 +1,206 @@
+/* Tests DeviceWaitLoop with a fake DeviceEventSource, and the parts of the
+ * device monitor that do not need a real USB bus.
+ *
+ * The devices come from a simulated bus that starts out empty, and the fake
+ * event source decides when a bootloader gets plugged in, so each case can
+ * check how many times the loop waited and what it saw. */
+
+#include "test.h"
+
+#include <chrono>
+
+/* What a fake event source does, and what happened to it.  The wait loop
+ * owns and deletes the source itself, so this outlives it.
+ *
+ * On one of its calls, the source plugs a bootloader into the bus.  On the
+ * others it returns right away as if a fallback poll timer had gone off, or,
+ * if it is never going to plug anything in, sleeps for the time it was given
+ * like a source that is not seeing any events. */
+class EventScript
+{
+public:
+    EventScript(uint32_t arrivalCall, bool announceArrival)
+        : bus(std::make_shared<PloaderSimBus>()), arrivalCall(arrivalCall),
+          announceArrival(announceArrival), callCount(0), arrivals(0)
+    {
+    }
+
+    std::shared_ptr<PloaderSimBus> bus;
+    uint32_t arrivalCall;  // 0 to never plug anything in
+    bool announceArrival;
+    uint32_t callCount;
+    uint32_t arrivals;
+    std::vector<uint32_t> maxWaits;
+};
+
+class FakeEventSource : public DeviceEventSource
+{
+public:
+    explicit FakeEventSource(EventScript & script) : script(script) { }
+
+    void waitForArrival(uint32_t maxWaitMs) override
+    {
+        script.callCount++;
+        script.maxWaits.push_back(maxWaitMs);
+
+        if (script.callCount == script.arrivalCall)
+        {
+            script.bus->addDevice(ploaderUserTypeLookup("p-star-45k50")
+                ->getMatchingTypes().at(0), "ARRIVED", false);
+            if (script.announceArrival) { script.arrivals++; }
+            return;
+        }
+
+        if (script.arrivalCall == 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(maxWaitMs));
+        }
+    }
+
+private:
+    EventScript & script;
+};
+
+// Runs a wait loop on the script's simulated bus, waiting for any bootloader.
+// Returns what waitUntil returned.
+static bool runWaitLoop(EventScript & script, uint32_t timeoutMs,
+    uint32_t & checkCount)
+{
+    ploaderSetBus(script.bus);
+    DeviceSelector selector;
+    DeviceWaitLoop loop(selector, timeoutMs,
+        std::unique_ptr<DeviceEventSource>(new FakeEventSource(script)));
+    checkCount = 0;
+    bool result = loop.waitUntil([&]()
+    {
+        checkCount++;
+        return !selector.listBootloaders().empty();
+    });
+    ploaderSetBus(NULL);
+    return result;
+}
+
+// The source reports an arrival on its first call, and the next check must
+// see the new device, which means the loop cleared the selector's stale lists.
+static void testArrival()
+{
+    EventScript script(1, true);
+    uint32_t checkCount;
+    bool found = runWaitLoop(script, 5000, checkCount);
+    TEST_CHECK(found);
+    TEST_CHECK(script.callCount == 1);
+    TEST_CHECK(script.arrivals == 1);
+    TEST_CHECK(checkCount == 2);
+}
+
+// Nothing ever arrives, so the loop gives up after the timeout, and it never
+// asks the source to wait past the end of the timeout.
+static void testTimeout()
+{
+    EventScript script(0, false);
+    const uint32_t timeoutMs = 60;
+    uint32_t checkCount;
+
+    auto start = std::chrono::steady_clock::now();
+    bool found = runWaitLoop(script, timeoutMs, checkCount);
+    uint32_t elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+
+    TEST_CHECK(!found);
+    TEST_CHECK(elapsedMs >= timeoutMs);
+    TEST_CHECK(script.callCount >= 1);
+    TEST_CHECK(checkCount == script.callCount + 1);
+    for (uint32_t maxWaitMs : script.maxWaits)
+    {
+        TEST_CHECK(maxWaitMs <= timeoutMs);
+    }
+}
+
+// The device shows up without an event, as if the uevent was missed, and the
+// loop must still find it on the source's next fallback poll.
+static void testFallbackPoll()
+{
+    EventScript script(3, false);
+    uint32_t checkCount;
+    bool found = runWaitLoop(script, 5000, checkCount);
+    TEST_CHECK(found);
+    TEST_CHECK(script.callCount == 3);
+    TEST_CHECK(script.arrivals == 0);
+    TEST_CHECK(checkCount == 4);
+}
+
+// The polling source never sleeps past the time it was given.
+static void testPollingEventSource()
+{
+    PollingEventSource source;
+    auto start = std::chrono::steady_clock::now();
+    source.waitForArrival(20);
+    uint32_t elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    TEST_CHECK(elapsedMs >= 20);
+    TEST_CHECK(elapsedMs < 100);
+
+    // USB events say nothing about simulated devices, so a simulated bus
+    // always gets the polling source.
+    ploaderSetBus(std::make_shared<PloaderSimBus>());
+    std::unique_ptr<DeviceEventSource> created = deviceEventSourceCreate();
+    TEST_CHECK(dynamic_cast<PollingEventSource *>(created.get()) != NULL);
+    ploaderSetBus(NULL);
+}
+
+// Builds a uevent message in the format the kernel uses: a summary, then
+// properties, each ending with a null character.
+static std::string kernelUevent(const std::vector<std::string> & lines)
+{
+    std::string message;
+    for (const std::string & line : lines)
+    {
+        message += line;
+        message += '\0';
+    }
+    return message;
+}
+
+static bool isArrival(const std::string & message)
+{
+    return ueventIsBootloaderArrival(message.data(), message.size());
+}
+
+static void testUevents()
+{
+    // A P-Star 45K50 bootloader (1ffb:0103) being plugged in.
+    TEST_CHECK(isArrival(kernelUevent({ "add@/devices/usb1/1-1",
+        "ACTION=add", "SUBSYSTEM=usb", "PRODUCT=1ffb/103/100" })));
+    TEST_CHECK(isArrival(kernelUevent({ "bind@/devices/usb1/1-1",
+        "ACTION=bind", "SUBSYSTEM=usb", "PRODUCT=1ffb/103/100" })));
+
+    // Removals, other subsystems, and apps are not bootloader arrivals.
+    TEST_CHECK(!isArrival(kernelUevent({ "remove@/devices/usb1/1-1",
+        "ACTION=remove", "SUBSYSTEM=usb", "PRODUCT=1ffb/103/100" })));
+    TEST_CHECK(!isArrival(kernelUevent({ "add@/devices/usb1/1-1",
+        "ACTION=add", "SUBSYSTEM=tty", "PRODUCT=1ffb/103/100" })));
+    TEST_CHECK(!isArrival(kernelUevent({ "add@/devices/usb1/1-1",
+        "ACTION=add", "SUBSYSTEM=usb", "PRODUCT=1ffb/b3/100" })));
+
+    // The udev format has a header that gives the offset of the properties.
+    std::string properties = kernelUevent({
+        "ACTION=add", "SUBSYSTEM=usb", "PRODUCT=1ffb/103/100" });
+    std::string udev(40, '\0');
+    memcpy(&udev[0], "libudev", 8);
+    uint32_t offset = udev.size();
+    memcpy(&udev[16], &offset, sizeof(offset));
+    TEST_CHECK(isArrival(udev + properties));
+
+    // A truncated udev header is ignored instead of being read past its end.
+    TEST_CHECK(!isArrival(udev.substr(0, 18)));
+}
+
+int main()
+{
+    testArrival();
+    testTimeout();
+    testFallbackPoll();
+    testPollingEventSource();
+    testUevents();
+    return testExitCode("device_wait");
+}